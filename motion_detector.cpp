@@ -5,31 +5,195 @@
 #include <cmath>
 #include <algorithm>
 #include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cctype>
 #include <chrono>
 #include <vector>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iomanip>
 #include <signal.h>
 #include <string>
+#include <fstream>
+#include <functional>
+#include <dirent.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <sstream>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+// SIMD diff kernels (selected at runtime, scalar fallback is always available)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 // Use system libjpeg-turbo instead of stb_image
 #include <jpeglib.h>
+#include <jerror.h>
 #include <setjmp.h>
 
 // PNG support using simple header-only library
 #include <stdio.h>
 #include <stdlib.h>
 
+// Rectangle in source image pixels
+struct MaskRect {
+    int x, y, width, height;
+};
+
+// Region-of-interest mask as given on the command line (compiled per frame size into spans)
+struct MaskSpec {
+    std::vector<unsigned char> pgm;  // Mask image, nonzero = active pixel
+    int pgm_width = 0;
+    int pgm_height = 0;
+    std::vector<MaskRect> ignore;    // Rectangles excluded from detection
+    
+    bool empty() const { return pgm.empty() && ignore.empty(); }
+};
+
 struct MotionDetectionParams {
     int pixel_threshold = 25;      
     int scale_factor = 1;          // Now used for decode-time scaling
     bool use_rgb = false;          // Use RGB instead of grayscale (slower)
     bool enable_blur = false;      
+    int blur_radius = 1;           // Box filter radius (-b <radius>), 1 = 3x3
+    int blur_passes = 1;           // Repeated box passes (2-3 approximate a Gaussian)
+    int block_size = 0;            // Compare NxN block means instead of pixels (0 = off)
+    bool dc_only = false;          // Compare luma DC coefficients only (1/8 scale, no IDCT)
+    bool coefficient_compare = false;  // Compare quantized DCT blocks, decode only ambiguous ones
+    bool decision_only = false;    // Stop scanning once the result against motion_threshold is known
+    bool lockstep = false;         // Decode both images row by row and diff each batch immediately
+    int grid_cols = 0;             // Per-tile motion map of grid_cols x grid_rows tiles (0 = off)
+    int grid_rows = 0;
+    std::string grid_bin;          // Also write the map in binary to this file
+    int background_shift = 0;      // Streams: compare with a running average, alpha = 1/2^shift (0 = previous frame)
+    size_t sample_budget = 0;      // Estimate motion from about this many sampled pixels (0 = all pixels)
+    bool sample_random = false;    // Stratified random samples instead of a fixed lattice
     float motion_threshold = 1.0f; 
     bool file_size_check = false;  
     float file_size_threshold = 5.0f; 
     bool verbose = false;          
     bool ultra_fast = false;       // Ultra-fast decode (lower quality)
+    bool use_simd = true;          // Use vectorized diff kernels when the CPU supports them
+    int threads = 1;               // Worker threads for motion calculation (0 = all cores)
+    MaskSpec mask;                 // Region of interest (--mask / --ignore)
+    bool use_roi = false;          // Decode only the --roi rectangle
+    MaskRect roi = { 0, 0, 0, 0 }; // Crop rectangle in source pixels
+    bool use_mmap = false;         // Map input files instead of reading them through stdio
+};
+
+// Decoder statistics reported in verbose mode
+struct DecodeStats {
+    std::atomic<size_t> bytes_copied{0};    // Bytes copied after libjpeg produced them (0 = zero-copy decode)
+    std::atomic<size_t> scanline_calls{0};  // Number of jpeg_read_scanlines() calls
+    std::atomic<size_t> scanlines{0};       // Number of scanlines decoded
+};
+
+static DecodeStats g_decode_stats;
+
+// Decoded frames come from a pool: buffers are 64-byte aligned (whole cache lines for the
+// SIMD kernels) and released buffers are kept for the next frame of the same size, so a
+// stream makes no frame allocations once warm. With --hugepages, buffers of 1 MB and more
+// are placed in 2 MB aligned regions marked MADV_HUGEPAGE (fewer TLB misses on x86 servers).
+class FramePool {
+public:
+    FramePool() {}
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+    ~FramePool() {
+        for (size_t i = 0; i < free_count_; i++) free(base_of(free_[i]));
+    }
+    
+    void set_hugepages(bool enable) { hugepages_ = enable; }
+    size_t allocations() const { return allocations_; }
+    size_t reuses() const { return reuses_; }
+    
+    unsigned char* acquire(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < free_count_; i++) {
+            if (header_of(free_[i])->size != size) continue;
+            unsigned char* buffer = free_[i];
+            free_[i] = free_[--free_count_];
+            reuses_++;
+            return buffer;
+        }
+        
+        // The header with the size sits in the first cache line, before the buffer
+        size_t alignment = ALIGNMENT;
+        size_t bytes = size + ALIGNMENT;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (hugepages_ && size >= HUGE_PAGE_SIZE / 2) {
+            alignment = HUGE_PAGE_SIZE;
+            bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        }
+#endif
+        void* base = nullptr;
+        if (posix_memalign(&base, alignment, bytes) != 0) return nullptr;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (alignment == HUGE_PAGE_SIZE) madvise(base, bytes, MADV_HUGEPAGE);
+#endif
+        allocations_++;
+        ((Header*)base)->size = size;
+        return (unsigned char*)base + ALIGNMENT;
+    }
+    
+    void release(unsigned char* buffer) {
+        if (!buffer) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_count_ < MAX_FREE) {
+            free_[free_count_++] = buffer;
+        } else {
+            free(base_of(buffer));
+        }
+    }
+    
+private:
+    static const size_t ALIGNMENT = 64;
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+    static const size_t MAX_FREE = 4;   // Released buffers kept for reuse
+    
+    struct Header {
+        size_t size;
+    };
+    static void* base_of(unsigned char* buffer) { return buffer - ALIGNMENT; }
+    static Header* header_of(unsigned char* buffer) { return (Header*)base_of(buffer); }
+    
+    std::mutex mutex_;
+    bool hugepages_ = false;
+    unsigned char* free_[MAX_FREE];
+    size_t free_count_ = 0;
+    size_t allocations_ = 0;
+    size_t reuses_ = 0;
+};
+
+static FramePool g_frame_pool;
+
+// Max rows handed to libjpeg per jpeg_read_scanlines() call
+static const int DECODE_BATCH_ROWS = 16;
+
+// Verbose decoder output is collected per image and written in one piece,
+// so images decoded on different threads don't interleave their lines
+static std::mutex g_output_mutex;
+
+struct BufferedLog {
+    std::ostringstream out;
+    ~BufferedLog() {
+        std::string text = out.str();
+        if (text.empty()) return;
+        std::lock_guard<std::mutex> lock(g_output_mutex);
+        std::cout << text << std::flush;
+    }
 };
 
 // Custom JPEG error handler
@@ -38,297 +202,3046 @@ struct jpeg_error_mgr_custom {
     jmp_buf setjmp_buffer;
 };
 
-void jpeg_error_exit_custom(j_common_ptr cinfo) {
-    jpeg_error_mgr_custom* err = (jpeg_error_mgr_custom*)cinfo->err;
-    longjmp(err->setjmp_buffer, 1);
+void jpeg_error_exit_custom(j_common_ptr cinfo) {
+    jpeg_error_mgr_custom* err = (jpeg_error_mgr_custom*)cinfo->err;
+    longjmp(err->setjmp_buffer, 1);
+}
+
+// Decode settings applied between jpeg_read_header() and jpeg_start_decompress(): decode-time
+// scaling (with the Pi Zero auto-scale for large frames), ultra-fast mode and luma-only output
+static void configure_decompress(j_decompress_ptr cinfo, const MotionDetectionParams& params, std::ostream& log) {
+    // DC-only mode is the 1/8-scale luma decode: libjpeg then keeps only the DC coefficient of each
+    // block (AC terms are entropy-decoded but not stored), the 1x1 "IDCT" is just the dequantized DC
+    // term (the block mean) and chroma is never reconstructed or colour converted
+    int scale_factor = params.dc_only ? 8 : params.scale_factor;
+    bool verbose = params.verbose;
+    bool grayscale = !params.use_rgb || params.dc_only;
+    
+    // Apply scale factor during decode - much more efficient!
+    if (scale_factor > 1) {
+        // libjpeg-turbo supports 1/2, 1/4, 1/8 scaling during decode
+        if (scale_factor >= 8) {
+            cinfo->scale_num = 1;
+            cinfo->scale_denom = 8;  // 1/8 scale
+            if (verbose && params.dc_only) log << "Decode: DC coefficients only (1/8 scale)" << std::endl;
+            else if (verbose) log << "Decode scaling: 1/8 (requested -s " << scale_factor << ")" << std::endl;
+        } else if (scale_factor >= 4) {
+            cinfo->scale_num = 1;
+            cinfo->scale_denom = 4;  // 1/4 scale
+            if (verbose) log << "Decode scaling: 1/4 (requested -s " << scale_factor << ")" << std::endl;
+        } else if (scale_factor >= 2) {
+            cinfo->scale_num = 1;
+            cinfo->scale_denom = 2;  // 1/2 scale
+            if (verbose) log << "Decode scaling: 1/2 (requested -s " << scale_factor << ")" << std::endl;
+        }
+    }
+    
+    // Additional Pi Zero safety: force scaling for large images (a small ROI is safe at full scale)
+    bool large_output = cinfo->image_width > 1280 || cinfo->image_height > 720;
+    if (params.use_roi) {
+        int64_t roi_width = std::min<int64_t>((int64_t)params.roi.x + params.roi.width, cinfo->image_width) - std::max(0, params.roi.x);
+        int64_t roi_height = std::min<int64_t>((int64_t)params.roi.y + params.roi.height, cinfo->image_height) - std::max(0, params.roi.y);
+        large_output = roi_width > 1280 || roi_height > 720;
+    }
+    if (large_output && scale_factor == 1) {
+        cinfo->scale_num = 1;
+        cinfo->scale_denom = 2;  // Force 1/2 scale for large images on Pi Zero
+        if (verbose) {
+            log << "Pi Zero safety: Auto-scaling " << cinfo->image_width << "x" << cinfo->image_height 
+                << " to 1/2 during decode" << std::endl;
+        }
+    }
+    
+    // Ultra-fast mode optimizations (like DC-only mode)
+    if (params.ultra_fast) {
+        cinfo->dct_method = JDCT_FASTEST;           // Fast IDCT (4-14% speedup)
+        cinfo->do_fancy_upsampling = FALSE;        // Fast upsampling (15-20% speedup)
+        cinfo->do_block_smoothing = FALSE;         // Disable smoothing for speed
+        cinfo->two_pass_quantize = FALSE;          // Single-pass quantization
+        if (verbose) {
+            log << " [ULTRA-FAST: fastest IDCT + upsampling]";
+        }
+    }
+    
+    // Grayscale mode: output only the luma plane (skips colour conversion and chroma upsampling)
+    if (grayscale && (cinfo->jpeg_color_space == JCS_YCbCr || cinfo->jpeg_color_space == JCS_GRAYSCALE)) {
+        cinfo->out_color_space = JCS_GRAYSCALE;
+        if (verbose) log << "Decode: luma only (JCS_GRAYSCALE)" << std::endl;
+    }
+}
+
+// Output region after jpeg_start_decompress(): the ROI in scaled pixels, or the whole image.
+// Returns false if the ROI lies outside the image.
+static bool decode_region(j_decompress_ptr cinfo, const MotionDetectionParams& params,
+                          JDIMENSION* crop_x, JDIMENSION* crop_y, JDIMENSION* crop_width, JDIMENSION* crop_height) {
+    int denom = cinfo->scale_denom / cinfo->scale_num;
+    *crop_x = 0;
+    *crop_y = 0;
+    *crop_width = cinfo->output_width;
+    *crop_height = cinfo->output_height;
+    if (!params.use_roi) return true;
+    
+    int64_t x0 = std::max(0, params.roi.x) / denom;
+    int64_t y0 = std::max(0, params.roi.y) / denom;
+    int64_t x1 = std::min<int64_t>(cinfo->output_width, ((int64_t)params.roi.x + params.roi.width + denom - 1) / denom);
+    int64_t y1 = std::min<int64_t>(cinfo->output_height, ((int64_t)params.roi.y + params.roi.height + denom - 1) / denom);
+    if (x0 >= x1 || y0 >= y1) {
+        std::cerr << "ROI is outside the image (" << cinfo->image_width << "x" << cinfo->image_height << ")" << std::endl;
+        return false;
+    }
+    *crop_x = (JDIMENSION)x0;
+    *crop_y = (JDIMENSION)y0;
+    *crop_width = (JDIMENSION)(x1 - x0);
+    *crop_height = (JDIMENSION)(y1 - y0);
+    return true;
+}
+
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER)
+// Partial decode: libjpeg-turbo only decodes the iMCU columns covering the ROI and skips
+// the rows above it. The crop start is rounded down to an iMCU boundary, so rows come out
+// decode_width pixels wide starting at decode_x and the ROI starts crop_x - decode_x pixels in.
+static void start_partial_decode(j_decompress_ptr cinfo, JDIMENSION crop_x, JDIMENSION crop_y, JDIMENSION crop_width,
+                                 JDIMENSION* decode_x, JDIMENSION* decode_width) {
+    *decode_x = crop_x;
+    *decode_width = crop_width;
+    if (crop_x > 0 || crop_width < cinfo->output_width) {
+        // Decode one extra column on each side of the ROI so chroma upsampling sees the same
+        // neighbours as in a full decode (the ROI pixels are then identical to a full decode)
+        JDIMENSION right = std::min<JDIMENSION>(cinfo->output_width, crop_x + crop_width + 1);
+        *decode_x = crop_x > 0 ? crop_x - 1 : 0;
+        *decode_width = right - *decode_x;
+        jpeg_crop_scanline(cinfo, decode_x, decode_width);
+    }
+    if (crop_y > 0) jpeg_skip_scanlines(cinfo, crop_y);
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// Arena memory manager
+// libjpeg allocates its working memory (IDCT and upsampling buffers, coefficient
+// arrays of progressive files) from pools that jpeg_abort_decompress() and
+// jpeg_destroy_decompress() hand back to malloc/free. A reused decoder installs
+// this manager instead: pools are bump allocators over blocks that are kept when
+// a pool is freed, so once the first frame of a size has been decoded, later
+// frames allocate nothing from the heap. Virtual arrays live entirely in memory
+// (no backing store), like with libjpeg's default jmemnobs build.
+// ---------------------------------------------------------------------------
+
+struct jvirt_sarray_control {
+    JSAMPARRAY mem_buffer;
+    JDIMENSION rows_in_array;
+    JDIMENSION samplesperrow;
+    int pool_id;
+    boolean pre_zero;
+    jvirt_sarray_ptr next;
+};
+
+struct jvirt_barray_control {
+    JBLOCKARRAY mem_buffer;
+    JDIMENSION rows_in_array;
+    JDIMENSION blocksperrow;
+    int pool_id;
+    boolean pre_zero;
+    jvirt_barray_ptr next;
+};
+
+class JpegArena {
+public:
+    JpegArena() {}
+    JpegArena(const JpegArena&) = delete;
+    JpegArena& operator=(const JpegArena&) = delete;
+    ~JpegArena() {
+        for (Pool& pool : pools_) {
+            for (Block& block : pool.blocks) free(block.data);
+        }
+    }
+    
+    // Take over the memory manager of a created decompressor (cinfo->client_data must point to this
+    // arena). Objects jpeg_create_decompress() already allocated stay with the original manager,
+    // which is destroyed together with cinfo.
+    void install(j_common_ptr cinfo) {
+        original_ = cinfo->mem;
+        pub_.alloc_small = alloc_small;
+        pub_.alloc_large = alloc_small;
+        pub_.alloc_sarray = alloc_sarray;
+        pub_.alloc_barray = alloc_barray;
+        pub_.request_virt_sarray = request_virt_sarray;
+        pub_.request_virt_barray = request_virt_barray;
+        pub_.realize_virt_arrays = realize_virt_arrays;
+        pub_.access_virt_sarray = access_virt_sarray;
+        pub_.access_virt_barray = access_virt_barray;
+        pub_.free_pool = free_pool;
+        pub_.self_destruct = self_destruct;
+        pub_.max_memory_to_use = original_->max_memory_to_use;
+        pub_.max_alloc_chunk = original_->max_alloc_chunk;
+        cinfo->mem = &pub_;
+    }
+    
+    size_t heap_allocations() const { return heap_allocations_; }
+    size_t reserved_bytes() const { return reserved_bytes_; }
+    
+private:
+    // Same alignment as libjpeg-turbo's manager; its SIMD code relies on it
+    static const size_t ALIGN = 32;
+    static const size_t MIN_BLOCK = 64 * 1024;
+    
+    struct Block {
+        unsigned char* data;
+        size_t size;
+        size_t used;
+    };
+    struct Pool {
+        std::vector<Block> blocks;
+        size_t current = 0;     // Blocks before this one are full
+    };
+    
+    static JpegArena* self(j_common_ptr cinfo) { return (JpegArena*)cinfo->client_data; }
+    
+    void* allocate(j_common_ptr cinfo, int pool_id, size_t size) {
+        if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+        size = (size + ALIGN - 1) & ~(ALIGN - 1);
+        Pool& pool = pools_[pool_id];
+        for (; pool.current < pool.blocks.size(); pool.current++) {
+            Block& block = pool.blocks[pool.current];
+            if (block.size - block.used >= size) {
+                void* p = block.data + block.used;
+                block.used += size;
+                return p;
+            }
+        }
+        
+        // Out of reserved blocks: only happens until the largest frame has been decoded once
+        size_t block_size = size > MIN_BLOCK ? size : MIN_BLOCK;
+        void* data = nullptr;
+        if (posix_memalign(&data, ALIGN, block_size) != 0) ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+        heap_allocations_++;
+        reserved_bytes_ += block_size;
+        pool.blocks.push_back({ (unsigned char*)data, block_size, size });
+        pool.current = pool.blocks.size() - 1;
+        return data;
+    }
+    
+    static void* alloc_small(j_common_ptr cinfo, int pool_id, size_t size) {
+        return self(cinfo)->allocate(cinfo, pool_id, size);
+    }
+    
+    // Rows are padded like libjpeg-turbo does, so SIMD routines may write past the nominal width
+    static JSAMPARRAY alloc_sarray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows) {
+        size_t row_size = ((size_t)samplesperrow + 2 * ALIGN - 1) & ~(2 * ALIGN - 1);
+        JSAMPARRAY rows = (JSAMPARRAY)self(cinfo)->allocate(cinfo, pool_id, numrows * sizeof(JSAMPROW));
+        JSAMPLE* data = (JSAMPLE*)self(cinfo)->allocate(cinfo, pool_id, row_size * numrows * sizeof(JSAMPLE));
+        for (JDIMENSION i = 0; i < numrows; i++) rows[i] = data + i * row_size;
+        return rows;
+    }
+    
+    static JBLOCKARRAY alloc_barray(j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows) {
+        JBLOCKARRAY rows = (JBLOCKARRAY)self(cinfo)->allocate(cinfo, pool_id, numrows * sizeof(JBLOCKROW));
+        JBLOCKROW data = (JBLOCKROW)self(cinfo)->allocate(cinfo, pool_id, (size_t)blocksperrow * numrows * sizeof(JBLOCK));
+        for (JDIMENSION i = 0; i < numrows; i++) rows[i] = data + (size_t)i * blocksperrow;
+        return rows;
+    }
+    
+    static jvirt_sarray_ptr request_virt_sarray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                                JDIMENSION samplesperrow, JDIMENSION numrows, JDIMENSION) {
+        JpegArena* arena = self(cinfo);
+        jvirt_sarray_ptr array = (jvirt_sarray_ptr)arena->allocate(cinfo, pool_id, sizeof(jvirt_sarray_control));
+        *array = { nullptr, numrows, samplesperrow, pool_id, pre_zero, arena->virt_sarrays_ };
+        arena->virt_sarrays_ = array;
+        return array;
+    }
+    
+    static jvirt_barray_ptr request_virt_barray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                                JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION) {
+        JpegArena* arena = self(cinfo);
+        jvirt_barray_ptr array = (jvirt_barray_ptr)arena->allocate(cinfo, pool_id, sizeof(jvirt_barray_control));
+        *array = { nullptr, numrows, blocksperrow, pool_id, pre_zero, arena->virt_barrays_ };
+        arena->virt_barrays_ = array;
+        return array;
+    }
+    
+    // Virtual arrays are allocated whole; pre-zeroed ones are cleared once here
+    static void realize_virt_arrays(j_common_ptr cinfo) {
+        JpegArena* arena = self(cinfo);
+        for (jvirt_sarray_ptr array = arena->virt_sarrays_; array; array = array->next) {
+            if (array->mem_buffer) continue;
+            array->mem_buffer = alloc_sarray(cinfo, array->pool_id, array->samplesperrow, array->rows_in_array);
+            if (array->pre_zero && array->rows_in_array > 0) {
+                size_t row_size = array->rows_in_array > 1 ? array->mem_buffer[1] - array->mem_buffer[0] : array->samplesperrow;
+                memset(array->mem_buffer[0], 0, row_size * array->rows_in_array);
+            }
+        }
+        for (jvirt_barray_ptr array = arena->virt_barrays_; array; array = array->next) {
+            if (array->mem_buffer) continue;
+            array->mem_buffer = alloc_barray(cinfo, array->pool_id, array->blocksperrow, array->rows_in_array);
+            if (array->pre_zero && array->rows_in_array > 0) {
+                memset(array->mem_buffer[0], 0, (size_t)array->blocksperrow * array->rows_in_array * sizeof(JBLOCK));
+            }
+        }
+    }
+    
+    static JSAMPARRAY access_virt_sarray(j_common_ptr cinfo, jvirt_sarray_ptr array, JDIMENSION start_row,
+                                         JDIMENSION num_rows, boolean) {
+        if (!array->mem_buffer || start_row + num_rows > array->rows_in_array) ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+        return array->mem_buffer + start_row;
+    }
+    
+    static JBLOCKARRAY access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr array, JDIMENSION start_row,
+                                          JDIMENSION num_rows, boolean) {
+        if (!array->mem_buffer || start_row + num_rows > array->rows_in_array) ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+        return array->mem_buffer + start_row;
+    }
+    
+    // Freeing a pool keeps its blocks for the next frame
+    static void free_pool(j_common_ptr cinfo, int pool_id) {
+        JpegArena* arena = self(cinfo);
+        if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+        jvirt_sarray_ptr* sarray = &arena->virt_sarrays_;
+        while (*sarray) {
+            if ((*sarray)->pool_id == pool_id) *sarray = (*sarray)->next;
+            else sarray = &(*sarray)->next;
+        }
+        jvirt_barray_ptr* barray = &arena->virt_barrays_;
+        while (*barray) {
+            if ((*barray)->pool_id == pool_id) *barray = (*barray)->next;
+            else barray = &(*barray)->next;
+        }
+        Pool& pool = arena->pools_[pool_id];
+        for (Block& block : pool.blocks) block.used = 0;
+        pool.current = 0;
+    }
+    
+    // jpeg_destroy_decompress(): hand back to the original manager; the blocks are released with the arena
+    static void self_destruct(j_common_ptr cinfo) {
+        JpegArena* arena = self(cinfo);
+        cinfo->mem = arena->original_;
+        (*cinfo->mem->self_destruct)(cinfo);
+    }
+    
+    struct jpeg_memory_mgr pub_;
+    struct jpeg_memory_mgr* original_ = nullptr;
+    Pool pools_[JPOOL_NUMPOOLS];
+    jvirt_sarray_ptr virt_sarrays_ = nullptr;
+    jvirt_barray_ptr virt_barrays_ = nullptr;
+    size_t heap_allocations_ = 0;
+    size_t reserved_bytes_ = 0;
+};
+
+// JPEG decompressor that can be kept across frames: the jpeg_decompress_struct is created once and
+// reset with jpeg_abort_decompress() after every image. A reused decoder (arena = true) also plugs in
+// JpegArena and always decodes from memory, since libjpeg-turbo does not let a decompressor switch
+// between stdio and memory sources.
+class JpegDecoder {
+public:
+    explicit JpegDecoder(bool arena = false) {
+        cinfo_.err = jpeg_std_error(&jerr_.pub);
+        jerr_.pub.error_exit = jpeg_error_exit_custom;
+        jpeg_create_decompress(&cinfo_);
+        if (arena) {
+            arena_.reset(new JpegArena);
+            cinfo_.client_data = arena_.get();
+            arena_->install((j_common_ptr)&cinfo_);
+        }
+    }
+    JpegDecoder(const JpegDecoder&) = delete;
+    JpegDecoder& operator=(const JpegDecoder&) = delete;
+    ~JpegDecoder() { jpeg_destroy_decompress(&cinfo_); }
+    
+    bool reads_from_memory() const { return arena_ != nullptr; }
+    size_t frames() const { return frames_; }
+    size_t allocation_free_frames() const { return allocation_free_frames_; }
+    const JpegArena* arena() const { return arena_.get(); }
+    
+    // Read a whole file into a buffer that is reused for every frame
+    const std::vector<unsigned char>* read_file(const char* filename) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        size_t size = 0;
+        file_data_.resize(fstat(fd, &st) == 0 && st.st_size > 0 ? (size_t)st.st_size : 64 * 1024);
+        for (;;) {
+            if (size == file_data_.size()) file_data_.resize(size * 2);
+            ssize_t n = read(fd, file_data_.data() + size, file_data_.size() - size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            size += (size_t)n;
+        }
+        close(fd);
+        file_data_.resize(size);
+        return size > 0 ? &file_data_ : nullptr;
+    }
+    
+    // Decode from a stdio stream (infile) or a memory buffer with the scale factor applied during decode.
+    // The caller owns infile; name is only used for messages.
+    unsigned char* decode(FILE* infile, const unsigned char* buffer, size_t buffer_size, const char* name,
+                          int* width, int* height, int* channels,
+                          const MotionDetectionParams& params, int* scale_denom = nullptr) {
+        int scale_factor = params.dc_only ? 8 : params.scale_factor;
+        bool verbose = params.verbose;
+        BufferedLog log;
+        if (verbose) {
+            log.out << "Loading JPEG with libjpeg-turbo: " << name;
+            if (!infile) {
+                log.out << " (from memory" << (params.use_mmap ? " map" : "") << ", " << buffer_size << " bytes)";
+            }
+            if (scale_factor > 1) {
+                log.out << " (decode scale: 1/" << scale_factor << ")";
+            }
+            log.out << std::endl;
+        }
+        
+        unsigned char* volatile image_data = nullptr;
+        
+        if (setjmp(jerr_.setjmp_buffer)) {
+            jpeg_abort_decompress(&cinfo_);
+            g_frame_pool.release(image_data);
+            if (verbose) std::cerr << "JPEG error during decompression" << std::endl;
+            return nullptr;
+        }
+        
+        frames_++;
+        size_t allocations = arena_ ? arena_->heap_allocations() : 0;
+        if (infile) {
+            jpeg_stdio_src(&cinfo_, infile);
+        } else {
+            // In-memory source: no file I/O at all
+            jpeg_mem_src(&cinfo_, (unsigned char*)buffer, (unsigned long)buffer_size);
+        }
+        jpeg_read_header(&cinfo_, TRUE);
+        configure_decompress(&cinfo_, params, log.out);
+        jpeg_start_decompress(&cinfo_);
+        
+        // Region to decode, in output (scaled) pixels
+        int denom = cinfo_.scale_denom / cinfo_.scale_num;
+        JDIMENSION crop_x, crop_y, crop_width, crop_height;
+        if (!decode_region(&cinfo_, params, &crop_x, &crop_y, &crop_width, &crop_height)) {
+            jpeg_abort_decompress(&cinfo_);
+            return nullptr;
+        }
+        
+        *width = crop_width;
+        *height = crop_height;
+        *channels = cinfo_.output_components;
+        if (scale_denom) *scale_denom = denom;
+        
+        if (verbose) {
+            log.out << "JPEG loaded: " << *width << "x" << *height << " channels=" << *channels 
+                      << " (memory: " << (*width * *height * *channels / 1024) << " KB)" << std::endl;
+        }
+        
+        // Allocate memory for image
+        size_t image_size = (size_t)(*width) * (*height) * (*channels);
+        image_data = g_frame_pool.acquire(image_size);
+        if (!image_data) {
+            jpeg_abort_decompress(&cinfo_);
+            if (verbose) std::cerr << "Cannot allocate memory for image (" << (image_size/1024) << " KB)" << std::endl;
+            return nullptr;
+        }
+        
+        size_t row_stride = (size_t)crop_width * cinfo_.output_components;
+        JSAMPROW rows[DECODE_BATCH_ROWS];
+        
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER)
+        // Partial decode into a buffer wide enough for the iMCU-aligned columns; the rows are
+        // shifted into place afterwards
+        JDIMENSION decode_x = crop_x, decode_width = crop_width;
+        if (params.use_roi) {
+            start_partial_decode(&cinfo_, crop_x, crop_y, crop_width, &decode_x, &decode_width);
+            if (decode_width != crop_width) {
+                g_frame_pool.release(image_data);
+                image_data = g_frame_pool.acquire((size_t)decode_width * crop_height * cinfo_.output_components);
+                if (!image_data) {
+                    jpeg_abort_decompress(&cinfo_);
+                    if (verbose) std::cerr << "Cannot allocate memory for image" << std::endl;
+                    return nullptr;
+                }
+            }
+            if (verbose) {
+                log.out << "ROI decode: " << crop_width << "x" << crop_height << " at " << crop_x << "," << crop_y
+                        << " (iMCU-aligned: " << decode_width << " columns from " << decode_x << ")" << std::endl;
+            }
+        }
+        size_t decode_stride = (size_t)decode_width * cinfo_.output_components;
+        
+        // Read scanlines straight into the image buffer (no intermediate row buffer, no memcpy)
+        JDIMENSION end_row = crop_y + crop_height;
+        while (cinfo_.output_scanline < end_row) {
+            JDIMENSION first = cinfo_.output_scanline;
+            JDIMENSION batch = std::min<JDIMENSION>(DECODE_BATCH_ROWS, end_row - first);
+            for (JDIMENSION i = 0; i < batch; i++) {
+                rows[i] = image_data + (first - crop_y + i) * decode_stride;
+            }
+            g_decode_stats.scanlines += jpeg_read_scanlines(&cinfo_, rows, batch);
+            g_decode_stats.scanline_calls++;
+        }
+        
+        // Drop the extra iMCU columns on either side of the ROI
+        if (decode_stride != row_stride) {
+            size_t skip = (size_t)(crop_x - decode_x) * cinfo_.output_components;
+            for (JDIMENSION y = 0; y < crop_height; y++) {
+                memmove(image_data + y * row_stride, image_data + y * decode_stride + skip, row_stride);
+            }
+            g_decode_stats.bytes_copied += row_stride * crop_height;
+        }
+#else
+        // Plain libjpeg has no partial decode: decode full rows and keep the ROI part
+        JSAMPARRAY full_row = (*cinfo_.mem->alloc_sarray)((j_common_ptr)&cinfo_, JPOOL_IMAGE,
+                                                         cinfo_.output_width * cinfo_.output_components, 1);
+        JDIMENSION end_row = crop_y + crop_height;
+        while (cinfo_.output_scanline < end_row) {
+            JDIMENSION y = cinfo_.output_scanline;
+            if (!params.use_roi) {
+                JDIMENSION batch = std::min<JDIMENSION>(DECODE_BATCH_ROWS, end_row - y);
+                for (JDIMENSION i = 0; i < batch; i++) {
+                    rows[i] = image_data + (y + i) * row_stride;
+                }
+                g_decode_stats.scanlines += jpeg_read_scanlines(&cinfo_, rows, batch);
+            } else {
+                g_decode_stats.scanlines += jpeg_read_scanlines(&cinfo_, full_row, 1);
+                if (y >= crop_y) {
+                    memcpy(image_data + (y - crop_y) * row_stride, full_row[0] + crop_x * cinfo_.output_components, row_stride);
+                    g_decode_stats.bytes_copied += row_stride;
+                }
+            }
+            g_decode_stats.scanline_calls++;
+        }
+#endif
+        
+        // Rows below the ROI are never decoded
+        if (cinfo_.output_scanline < cinfo_.output_height) {
+            jpeg_abort_decompress(&cinfo_);
+        } else {
+            jpeg_finish_decompress(&cinfo_);
+        }
+        if (arena_ && arena_->heap_allocations() == allocations) allocation_free_frames_++;
+        
+        return image_data;
+    }
+    
+private:
+    struct jpeg_decompress_struct cinfo_;
+    struct jpeg_error_mgr_custom jerr_;
+    std::unique_ptr<JpegArena> arena_;
+    std::vector<unsigned char> file_data_;
+    size_t frames_ = 0;
+    size_t allocation_free_frames_ = 0;     // Frames decoded without a heap allocation in libjpeg
+};
+
+// Decode a JPEG from a stdio stream (infile) or a memory buffer with the scale factor applied during decode,
+// with a reused decoder if one is given. The caller owns infile; name is only used for messages.
+unsigned char* decode_jpeg(FILE* infile, const unsigned char* buffer, size_t buffer_size, const char* name,
+                           int* width, int* height, int* channels,
+                           const MotionDetectionParams& params, int* scale_denom = nullptr,
+                           JpegDecoder* decoder = nullptr) {
+    if (decoder) return decoder->decode(infile, buffer, buffer_size, name, width, height, channels, params, scale_denom);
+    JpegDecoder one_shot;
+    return one_shot.decode(infile, buffer, buffer_size, name, width, height, channels, params, scale_denom);
+}
+
+// Load JPEG file through mmap: the decoder reads the page cache directly (no read() calls into a stdio buffer).
+// Returns false if the file cannot be mapped (e.g. a pipe), so the caller can fall back to stdio.
+bool load_jpeg_mmap(const char* filename, int* width, int* height, int* channels,
+                    const MotionDetectionParams& params, int* scale_denom, unsigned char** image_data,
+                    JpegDecoder* decoder = nullptr) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    
+    // JPEG is consumed front to back - let the kernel read ahead aggressively
+    madvise(map, size, MADV_SEQUENTIAL);
+    
+    *image_data = decode_jpeg(nullptr, (const unsigned char*)map, size, filename, width, height, channels,
+                              params, scale_denom, decoder);
+    munmap(map, size);
+    return true;
+}
+
+// Load JPEG file using libjpeg-turbo with scale factor applied during decode
+unsigned char* load_jpeg_safe(const char* filename, int* width, int* height, int* channels, 
+                              const MotionDetectionParams& params, int* scale_denom = nullptr,
+                              JpegDecoder* decoder = nullptr) {
+    unsigned char* mapped_image = nullptr;
+    if (params.use_mmap &&
+        load_jpeg_mmap(filename, width, height, channels, params, scale_denom, &mapped_image, decoder)) {
+        return mapped_image;
+    }
+    
+    if (decoder && decoder->reads_from_memory()) {
+        const std::vector<unsigned char>* data = decoder->read_file(filename);
+        if (!data) {
+            if (params.verbose) std::cerr << "Cannot open file: " << filename << std::endl;
+            return nullptr;
+        }
+        return decode_jpeg(nullptr, data->data(), data->size(), filename, width, height, channels, params,
+                           scale_denom, decoder);
+    }
+    
+    FILE* infile = fopen(filename, "rb");
+    if (!infile) {
+        if (params.verbose) std::cerr << "Cannot open file: " << filename << std::endl;
+        return nullptr;
+    }
+    
+    unsigned char* image_data = decode_jpeg(infile, nullptr, 0, filename, width, height, channels, params, scale_denom,
+                                            decoder);
+    fclose(infile);
+    return image_data;
+}
+
+// Load JPEG already in memory (stdin frames, capture buffers)
+unsigned char* load_jpeg_mem(const unsigned char* buffer, size_t size, const char* name,
+                             int* width, int* height, int* channels,
+                             const MotionDetectionParams& params, int* scale_denom = nullptr,
+                             JpegDecoder* decoder = nullptr) {
+    if (!buffer || size == 0) return nullptr;
+    return decode_jpeg(nullptr, buffer, size, name, width, height, channels, params, scale_denom, decoder);
+}
+
+// Check for a .jpg/.jpeg extension (case-insensitive)
+bool is_jpeg_filename(const char* filename) {
+    const char* ext = strrchr(filename, '.');
+    if (!ext) return false;
+    
+    // Convert to lowercase for comparison
+    std::string ext_lower = ext;
+    std::transform(ext_lower.begin(), ext_lower.end(), ext_lower.begin(), ::tolower);
+    return ext_lower == ".jpg" || ext_lower == ".jpeg";
+}
+
+// Load image using appropriate loader with scaling
+unsigned char* load_image_safe(const char* filename, int* width, int* height, int* channels, 
+                               const MotionDetectionParams& params, int* scale_denom = nullptr,
+                               JpegDecoder* decoder = nullptr) {
+    bool verbose = params.verbose;
+    if (!filename || !width || !height || !channels) {
+        return nullptr;
+    }
+    
+    // Check file extension
+    const char* ext = strrchr(filename, '.');
+    if (!ext) {
+        if (verbose) std::cerr << "No file extension found" << std::endl;
+        return nullptr;
+    }
+    
+    if (is_jpeg_filename(filename)) {
+        return load_jpeg_safe(filename, width, height, channels, params, scale_denom, decoder);
+    } else {
+        if (verbose) std::cerr << "Unsupported file format: " << ext << " (only JPEG supported)" << std::endl;
+        return nullptr;
+    }
+}
+
+// Row-by-row JPEG decoder: scanlines are decoded in batches of DECODE_BATCH_ROWS into a small
+// buffer and handed out in order, so only one batch of rows is resident at a time.
+// libjpeg errors make open() return false and row() return nullptr (see failed()).
+class ScanlineReader {
+public:
+    ScanlineReader() {
+        cinfo_.err = jpeg_std_error(&jerr_.pub);
+        jerr_.pub.error_exit = jpeg_error_exit_custom;
+    }
+    ~ScanlineReader() { close(); }
+    
+    // Read the header and start decompression with the same settings as decode_jpeg()
+    bool open(const char* filename, const MotionDetectionParams& params) {
+        BufferedLog log;
+        infile_ = fopen(filename, "rb");
+        if (!infile_) {
+            if (params.verbose) std::cerr << "Cannot open file: " << filename << std::endl;
+            return false;
+        }
+        jpeg_create_decompress(&cinfo_);
+        created_ = true;
+        if (setjmp(jerr_.setjmp_buffer)) {
+            failed_ = true;
+            return false;
+        }
+        jpeg_stdio_src(&cinfo_, infile_);
+        jpeg_read_header(&cinfo_, TRUE);
+        configure_decompress(&cinfo_, params, log.out);
+        jpeg_start_decompress(&cinfo_);
+        
+        JDIMENSION crop_x, crop_y, crop_width, crop_height;
+        if (!decode_region(&cinfo_, params, &crop_x, &crop_y, &crop_width, &crop_height)) return false;
+        width_ = crop_width;
+        height_ = crop_height;
+        scale_denom_ = cinfo_.scale_denom / cinfo_.scale_num;
+        
+        JDIMENSION decode_x = 0, decode_width = cinfo_.output_width;
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER)
+        if (params.use_roi) start_partial_decode(&cinfo_, crop_x, crop_y, crop_width, &decode_x, &decode_width);
+#endif
+        stride_ = (size_t)decode_width * cinfo_.output_components;
+        offset_ = (size_t)(crop_x - decode_x) * cinfo_.output_components;
+        buffer_.resize(stride_ * DECODE_BATCH_ROWS);
+        
+        // Plain libjpeg has no scanline skipping: decode and drop the rows above the ROI
+        while (cinfo_.output_scanline < crop_y) {
+            JSAMPROW row = buffer_.data();
+            g_decode_stats.scanlines += jpeg_read_scanlines(&cinfo_, &row, 1);
+            g_decode_stats.scanline_calls++;
+        }
+        return true;
+    }
+    
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int channels() const { return cinfo_.output_components; }
+    int scale_denom() const { return scale_denom_; }
+    int rows_decoded() const { return rows_decoded_; }
+    size_t buffer_bytes() const { return buffer_.size(); }
+    bool failed() const { return failed_; }
+    
+    // Decode only the requested row instead of a whole batch (for sparse row access)
+    void set_single_rows(bool single) { batch_rows_ = single ? 1 : DECODE_BATCH_ROWS; }
+    
+    // Row y of the output region; y must not decrease, the pointer is valid until the next batch.
+    // nullptr if libjpeg reports an error (the reader stays failed).
+    const unsigned char* row(int y) {
+        if (failed_) return nullptr;
+        if (y >= next_row_) {
+            if (setjmp(jerr_.setjmp_buffer)) {
+                failed_ = true;
+                return nullptr;
+            }
+            skip_to(y - y % batch_rows_);   // Only whole batches are skipped
+            while (y >= next_row_) {
+                int batch = std::min(batch_rows_, height_ - next_row_);
+                JSAMPROW rows[DECODE_BATCH_ROWS];
+                for (int i = 0; i < batch; i++) rows[i] = buffer_.data() + i * stride_;
+                for (int done = 0; done < batch;) {
+                    done += jpeg_read_scanlines(&cinfo_, rows + done, batch - done);
+                    g_decode_stats.scanline_calls++;
+                }
+                g_decode_stats.scanlines += batch;
+                rows_decoded_ += batch;
+                batch_first_ = next_row_;
+                next_row_ += batch;
+            }
+        }
+        return buffer_.data() + (y - batch_first_) * stride_ + offset_;
+    }
+    
+    // Stop decoding; rows that were never requested are not decoded
+    void close() {
+        if (created_) {
+            jpeg_destroy_decompress(&cinfo_);
+            created_ = false;
+        }
+        if (infile_) {
+            fclose(infile_);
+            infile_ = nullptr;
+        }
+    }
+    
+private:
+    // Skip ahead so the next decoded row is y. libjpeg-turbo skips whole iMCU rows without the IDCT;
+    // rows inside an iMCU row are already decoded and are read and dropped (skipping those with
+    // jpeg_skip_scanlines() can return stale rows in libjpeg-turbo 2.1).
+    void skip_to(int y) {
+        if (y <= next_row_) return;
+        JDIMENSION target = cinfo_.output_scanline + (y - next_row_);
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER)
+        JDIMENSION imcu_rows = cinfo_.max_v_samp_factor * cinfo_.min_DCT_scaled_size;
+        JDIMENSION boundary = (cinfo_.output_scanline + imcu_rows - 1) / imcu_rows * imcu_rows;
+        if (target >= boundary + imcu_rows) {
+            discard_to(boundary);
+            jpeg_skip_scanlines(&cinfo_, (target - boundary) / imcu_rows * imcu_rows);
+        }
+#endif
+        discard_to(target);
+        next_row_ = y;
+        batch_first_ = y;
+    }
+    
+    // Decode and drop rows until output scanline target
+    void discard_to(JDIMENSION target) {
+        while (cinfo_.output_scanline < target) {
+            JSAMPROW row = buffer_.data();
+            jpeg_read_scanlines(&cinfo_, &row, 1);
+            g_decode_stats.scanline_calls++;
+            rows_decoded_++;
+        }
+    }
+    
+    struct jpeg_decompress_struct cinfo_;
+    struct jpeg_error_mgr_custom jerr_;
+    bool created_ = false;
+    bool failed_ = false;
+    FILE* infile_ = nullptr;
+    int width_ = 0, height_ = 0, scale_denom_ = 1;
+    size_t stride_ = 0, offset_ = 0;
+    int next_row_ = 0, batch_first_ = 0;
+    int batch_rows_ = DECODE_BATCH_ROWS;
+    int rows_decoded_ = 0;
+    std::vector<unsigned char> buffer_;
+};
+
+// Horizontal box pass over rows radius..height-1-radius using a running sum, so the cost per pixel
+// does not depend on the radius (edge rows and columns keep their values)
+static void blur_horizontal_pass(unsigned char* img, int width, int height, int channels, int blur_channels,
+                                 int radius = 1) {
+    int window = 2 * radius + 1;
+    std::vector<unsigned char> temp_row((size_t)width * channels);
+    for (int y = radius; y < height - radius; y++) {
+        unsigned char* row = img + (size_t)y * width * channels;
+        memcpy(temp_row.data(), row, temp_row.size());
+        for (int c = 0; c < blur_channels; c++) {
+            const unsigned char* src = temp_row.data() + c;
+            int sum = 0;
+            for (int x = 0; x < window; x++) sum += src[x * channels];
+            for (int x = radius; x < width - radius; x++) {
+                row[x * channels + c] = sum / window;
+                if (x + radius + 1 < width) {
+                    sum += src[(x + radius + 1) * channels] - src[(x - radius) * channels];
+                }
+            }
+        }
+    }
+}
+
+// Vertical box pass walking rows in memory order with a rolling column-sum accumulator.
+// Rows are overwritten in place, so the unfiltered copies of the rows still inside the
+// window (above the current row) are kept in a small ring.
+static void blur_vertical_pass(unsigned char* img, int width, int height, int channels, int blur_channels,
+                               int radius = 1) {
+    int window = 2 * radius + 1;
+    size_t row_size = (size_t)width * channels;
+    std::vector<std::vector<unsigned char>> saved(radius + 1, std::vector<unsigned char>(row_size));
+    std::vector<uint32_t> column_sum(row_size, 0);
+    
+    for (int y = 0; y < window && y < height; y++) {
+        const unsigned char* row = img + y * row_size;
+        for (size_t i = 0; i < row_size; i++) column_sum[i] += row[i];
+    }
+    
+    for (int y = radius; y < height - radius; y++) {
+        unsigned char* row = img + y * row_size;
+        std::vector<unsigned char>& unfiltered = saved[y % (radius + 1)];
+        memcpy(unfiltered.data(), row, row_size);
+        for (int x = radius; x < width - radius; x++) {
+            for (int c = 0; c < blur_channels; c++) {
+                int i = x * channels + c;
+                row[i] = column_sum[i] / window;
+            }
+        }
+        
+        // Slide the window down: add the next unfiltered row, drop the top one
+        if (y + radius + 1 < height) {
+            int top = y - radius;
+            const unsigned char* leaving = top < radius ? img + top * row_size : saved[top % (radius + 1)].data();
+            const unsigned char* entering = img + (y + radius + 1) * row_size;
+            for (size_t i = 0; i < row_size; i++) column_sum[i] += entering[i] - leaving[i];
+        }
+    }
+}
+
+// Previous column-by-column vertical pass, kept as the --bench-blur baseline.
+// Every access strides a full row, which thrashes the cache on large frames.
+static void blur_vertical_pass_columns(unsigned char* img, int width, int height, int channels, int blur_channels) {
+    std::vector<unsigned char> temp_col(height * blur_channels);
+    for (int x = 1; x < width - 1; x++) {
+        for (int c = 0; c < blur_channels; c++) {
+            for (int y = 1; y < height - 1; y++) {
+                int sum = img[((y - 1) * width + x) * channels + c] +
+                         img[(y * width + x) * channels + c] +
+                         img[((y + 1) * width + x) * channels + c];
+                temp_col[y * blur_channels + c] = sum / 3;
+            }
+        }
+        // Copy back
+        for (int y = 1; y < height - 1; y++) {
+            for (int c = 0; c < blur_channels; c++) {
+                img[(y * width + x) * channels + c] = temp_col[y * blur_channels + c];
+            }
+        }
+    }
+}
+
+// Ultra-fast blur: convert to grayscale first, then blur only one channel.
+// Box filter of the given radius, repeated passes times (2-3 passes approximate a Gaussian).
+void apply_blur_fast(unsigned char* img, int width, int height, int channels, bool use_rgb,
+                     int radius = 1, int passes = 1) {
+    if (!img || radius < 1 || width < 2 * radius + 1 || height < 2 * radius + 1) return;
+    
+    bool average_gray = !use_rgb && channels >= 3;
+    if (average_gray) {
+        // Convert to grayscale first, then blur only channel 0
+        for (int i = 0; i < width * height; i++) {
+            img[i * channels] = (img[i * channels] + img[i * channels + 1] + img[i * channels + 2]) / 3;
+        }
+    }
+    
+    // Now blur only the first channel (or all if RGB mode)
+    int blur_channels = use_rgb ? channels : 1;
+    
+    // Fast separable blur: horizontal then vertical (much faster!)
+    for (int pass = 0; pass < passes; pass++) {
+        blur_horizontal_pass(img, width, height, channels, blur_channels, radius);
+        blur_vertical_pass(img, width, height, channels, blur_channels, radius);
+    }
+    
+    if (average_gray) {
+        // Spread the blurred gray to the other channels so their average is the blurred value
+        for (int i = 0; i < width * height; i++) {
+            img[i * channels + 1] = img[i * channels + 2] = img[i * channels];
+        }
+    }
+}
+
+// --bench-blur: time the column-order and row-order vertical passes at common frame sizes
+int run_blur_benchmark() {
+    const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+    const int channel_modes[] = { 1, 3 };
+    
+    std::cout << "Vertical blur pass benchmark (column order vs row order)" << std::endl;
+    std::cout << std::fixed << std::setprecision(3);
+    bool all_identical = true;
+    
+    for (const auto& size : sizes) {
+        int width = size[0], height = size[1];
+        for (int channels : channel_modes) {
+            // Deterministic noisy test frame
+            size_t image_size = (size_t)width * height * channels;
+            std::vector<unsigned char> source(image_size);
+            uint32_t seed = 12345;
+            for (size_t i = 0; i < image_size; i++) {
+                seed = seed * 1103515245u + 12345u;
+                source[i] = (unsigned char)(seed >> 24);
+            }
+            
+            std::vector<unsigned char> by_columns(source), by_rows(source);
+            int iterations = std::max(3, (int)(20000000 / ((size_t)width * height)));
+            
+            auto column_start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                blur_vertical_pass_columns(by_columns.data(), width, height, channels, channels);
+            }
+            auto column_end = std::chrono::high_resolution_clock::now();
+            
+            auto row_start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                blur_vertical_pass(by_rows.data(), width, height, channels, channels);
+            }
+            auto row_end = std::chrono::high_resolution_clock::now();
+            
+            double column_ms = std::chrono::duration_cast<std::chrono::microseconds>(column_end - column_start).count()
+                               / 1000.0 / iterations;
+            double row_ms = std::chrono::duration_cast<std::chrono::microseconds>(row_end - row_start).count()
+                            / 1000.0 / iterations;
+            bool identical = by_columns == by_rows;
+            all_identical = all_identical && identical;
+            
+            std::cout << "  " << width << "x" << height << " (" << channels << " ch): column order "
+                      << column_ms << " ms, row order " << row_ms << " ms, speedup "
+                      << std::setprecision(2) << (row_ms > 0 ? column_ms / row_ms : 0.0) << "x"
+                      << std::setprecision(3) << (identical ? "" : "  OUTPUT MISMATCH") << std::endl;
+        }
+    }
+    
+    return all_identical ? 0 : 1;
+}
+
+// Streaming version of apply_blur_fast(): produces the blurred frame one row at a time, so blur
+// needs O(width * radius) scratch instead of a full-frame copy. Each pass keeps a rolling window
+// of horizontally blurred rows plus running column sums, so the cost per pixel is constant for any
+// radius. Passes are chained: pass k pulls its input rows from pass k-1.
+// Rows must be requested in increasing order. Output is identical to apply_blur_fast() followed
+// by the grayscale average; in grayscale mode on 3-channel input the rows are converted to
+// 1-channel gray first.
+// The input is a whole image or a row source; each source row is fetched exactly once, in order,
+// so rows can come straight from a decoder.
+class RowBlur {
+public:
+    typedef std::function<const unsigned char*(int)> RowSource;
+    
+    RowBlur(const unsigned char* img, int width, int height, int channels, bool use_rgb,
+            int radius = 1, int passes = 1)
+        : RowBlur([img, width, channels](int y) { return img + (size_t)y * width * channels; },
+                  width, height, channels, use_rgb, radius, passes) {}
+    
+    RowBlur(const RowSource& source, int width, int height, int channels, bool use_rgb,
+            int radius = 1, int passes = 1)
+        : source_(source), width_(width), height_(height), channels_(channels),
+          average_gray_(!use_rgb && channels >= 3), radius_(radius) {
+        out_channels_ = average_gray_ ? 1 : channels;
+        size_t row_size = (size_t)width * out_channels_;
+        enabled_ = radius >= 1 && width >= 2 * radius + 1 && height >= 2 * radius + 1;
+        stages_.resize(enabled_ ? std::max(1, passes) : 0);
+        for (Stage& stage : stages_) {
+            stage.window.assign(2 * radius + 2, std::vector<unsigned char>(row_size));
+            stage.window_row.assign(2 * radius + 2, -1);
+            stage.column_sum.assign(row_size, 0);
+            stage.out.resize(row_size);
+        }
+        if (average_gray_) gray_.resize(width);
+    }
+    
+    // Channels of the rows returned by row()
+    int channels() const { return out_channels_; }
+    
+    // Blurred row y (valid until the next call), nullptr if the source fails
+    const unsigned char* row(int y) {
+        if (!enabled_) return source_row(y);
+        return stage_row((int)stages_.size() - 1, y);
+    }
+    
+private:
+    struct Stage {
+        std::vector<std::vector<unsigned char>> window;  // Horizontally blurred rows (ring)
+        std::vector<int> window_row;                     // Row held by each ring slot
+        std::vector<uint32_t> column_sum;                // Sum of rows [sum_first, sum_last]
+        int sum_first = 0;
+        int sum_last = -1;
+        int next_row = -1;                               // Next row to pull from the input
+        std::vector<unsigned char> out;
+    };
+    
+    bool edge_row(int y) const { return y < radius_ || y >= height_ - radius_; }
+    
+    // Source row in output channel layout (converted to gray if needed)
+    const unsigned char* source_row(int y) {
+        const unsigned char* src = source_(y);
+        if (!src || !average_gray_) return src;
+        for (int x = 0; x < width_; x++) {
+            const unsigned char* p = src + x * channels_;
+            gray_[x] = (p[0] + p[1] + p[2]) / 3;
+        }
+        return gray_.data();
+    }
+    
+    // Horizontally blurred row y of a pass; input rows are pulled strictly in order
+    const unsigned char* horizontal(int k, int y) {
+        Stage& stage = stages_[k];
+        int slots = (int)stage.window.size();
+        // Starting inside the top edge band: later rows need the band rows above y too
+        if (stage.next_row < 0) stage.next_row = y < radius_ ? 0 : y;
+        
+        while (stage.next_row <= y) {
+            int r = stage.next_row++;
+            const unsigned char* src = k == 0 ? source_row(r) : stage_row(k - 1, r);
+            if (!src) return nullptr;
+            unsigned char* dst = stage.window[r % slots].data();
+            stage.window_row[r % slots] = r;
+            memcpy(dst, src, (size_t)width_ * out_channels_);
+            if (edge_row(r)) continue;   // Edge rows skip the horizontal pass
+            
+            int oc = out_channels_;
+            int window = 2 * radius_ + 1;
+            for (int c = 0; c < oc; c++) {
+                int sum = 0;
+                for (int x = 0; x < window; x++) sum += src[x * oc + c];
+                for (int x = radius_; x < width_ - radius_; x++) {
+                    dst[x * oc + c] = sum / window;
+                    if (x + radius_ + 1 < width_) {
+                        sum += src[(x + radius_ + 1) * oc + c] - src[(x - radius_) * oc + c];
+                    }
+                }
+            }
+        }
+        return stage.window[y % slots].data();
+    }
+    
+    // Output row y of a pass
+    const unsigned char* stage_row(int k, int y) {
+        if (edge_row(y)) return horizontal(k, y);   // Edge rows are not blurred
+        
+        Stage& stage = stages_[k];
+        size_t row_size = (size_t)width_ * out_channels_;
+        int first = y - radius_, last = y + radius_;
+        
+        // Move the column-sum window to [y - radius, y + radius]
+        if (stage.sum_last < stage.sum_first || first > stage.sum_last) {
+            std::fill(stage.column_sum.begin(), stage.column_sum.end(), 0);
+            stage.sum_first = first;
+            stage.sum_last = first - 1;
+        }
+        while (stage.sum_first < first) {
+            const unsigned char* leaving = stage.window[stage.sum_first % stage.window.size()].data();
+            for (size_t i = 0; i < row_size; i++) stage.column_sum[i] -= leaving[i];
+            stage.sum_first++;
+        }
+        while (stage.sum_last < last) {
+            const unsigned char* entering = horizontal(k, ++stage.sum_last);
+            if (!entering) return nullptr;
+            for (size_t i = 0; i < row_size; i++) stage.column_sum[i] += entering[i];
+        }
+        
+        // Vertical pass; edge columns keep their (unblurred) values
+        int oc = out_channels_;
+        uint32_t window = 2 * radius_ + 1;
+        unsigned char* out = stage.out.data();
+        memcpy(out, horizontal(k, y), row_size);
+        for (size_t i = (size_t)radius_ * oc; i < (size_t)(width_ - radius_) * oc; i++) {
+            out[i] = stage.column_sum[i] / window;
+        }
+        return out;
+    }
+    
+    RowSource source_;
+    int width_, height_, channels_;
+    bool average_gray_;
+    int radius_;
+    int out_channels_;
+    bool enabled_;
+    std::vector<Stage> stages_;
+    std::vector<unsigned char> gray_;
+};
+
+// ---------------------------------------------------------------------------
+// Changed-pixel counting kernels
+// All kernels count pixels where |a - b| > threshold in any channel and expect
+// 0 <= threshold <= 254 (count_changed_pixels() handles the other values).
+// SIMD variants are bit-exact with the scalar ones.
+// ---------------------------------------------------------------------------
+
+static size_t count_changed_gray_scalar(const unsigned char* a, const unsigned char* b, size_t n, int threshold) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += abs((int)a[i] - (int)b[i]) > threshold;
+    }
+    return count;
+}
+
+static size_t count_changed_rgb_scalar(const unsigned char* a, const unsigned char* b, size_t pixels, int threshold) {
+    size_t count = 0;
+    for (size_t i = 0; i < pixels * 3; i += 3) {
+        count += (abs((int)a[i] - (int)b[i]) > threshold) |
+                 (abs((int)a[i + 1] - (int)b[i + 1]) > threshold) |
+                 (abs((int)a[i + 2] - (int)b[i + 2]) > threshold);
+    }
+    return count;
+}
+
+#if defined(__SSE2__)
+// Saturating |a - b| >= threshold + 1 as a 0x00/0xFF byte mask
+static inline __m128i changed_mask_sse2(__m128i va, __m128i vb, __m128i limit) {
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+    return _mm_cmpeq_epi8(_mm_max_epu8(diff, limit), diff);
+}
+
+static size_t count_changed_gray_sse2(const unsigned char* a, const unsigned char* b, size_t n, int threshold) {
+    const __m128i limit = _mm_set1_epi8((char)(threshold + 1));
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i m = changed_mask_sse2(_mm_loadu_si128((const __m128i*)(a + i)),
+                                      _mm_loadu_si128((const __m128i*)(b + i)), limit);
+        count += __builtin_popcount(_mm_movemask_epi8(m));
+    }
+    return count + count_changed_gray_scalar(a + i, b + i, n - i, threshold);
+}
+
+// 16 RGB pixels per step: the three 16-byte masks form a 48-bit mask and a
+// pixel is changed when any of its 3 bits is set
+static size_t count_changed_rgb_sse2(const unsigned char* a, const unsigned char* b, size_t pixels, int threshold) {
+    const __m128i limit = _mm_set1_epi8((char)(threshold + 1));
+    const uint64_t pixel_bits = 0x249249249249ULL;  // bit 3*k for k = 0..15
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        const unsigned char* pa = a + i * 3;
+        const unsigned char* pb = b + i * 3;
+        uint64_t m0 = (uint64_t)_mm_movemask_epi8(changed_mask_sse2(_mm_loadu_si128((const __m128i*)pa),
+                                                                    _mm_loadu_si128((const __m128i*)pb), limit));
+        uint64_t m1 = (uint64_t)_mm_movemask_epi8(changed_mask_sse2(_mm_loadu_si128((const __m128i*)(pa + 16)),
+                                                                    _mm_loadu_si128((const __m128i*)(pb + 16)), limit));
+        uint64_t m2 = (uint64_t)_mm_movemask_epi8(changed_mask_sse2(_mm_loadu_si128((const __m128i*)(pa + 32)),
+                                                                    _mm_loadu_si128((const __m128i*)(pb + 32)), limit));
+        uint64_t m = m0 | (m1 << 16) | (m2 << 32);
+        count += __builtin_popcountll((m | (m >> 1) | (m >> 2)) & pixel_bits);
+    }
+    return count + count_changed_rgb_scalar(a + i * 3, b + i * 3, pixels - i, threshold);
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MOTION_HAVE_AVX2 1
+__attribute__((target("avx2")))
+static size_t count_changed_gray_avx2(const unsigned char* a, const unsigned char* b, size_t n, int threshold) {
+    const __m256i limit = _mm256_set1_epi8((char)(threshold + 1));
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(diff, limit), diff);
+        count += __builtin_popcount((unsigned)_mm256_movemask_epi8(m));
+    }
+    return count + count_changed_gray_scalar(a + i, b + i, n - i, threshold);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+// Sum of the per-lane counters (each lane <= 255)
+static inline size_t horizontal_sum_neon(uint8x16_t acc) {
+    uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(acc)));
+    return (size_t)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+}
+
+static size_t count_changed_gray_neon(const unsigned char* a, const unsigned char* b, size_t n, int threshold) {
+    const uint8x16_t limit = vdupq_n_u8((uint8_t)threshold);
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 16 <= n) {
+        // Lane counters are flushed every 255 blocks so they cannot overflow
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (int block = 0; block < 255 && i + 16 <= n; block++, i += 16) {
+            uint8x16_t m = vcgtq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)), limit);
+            acc = vsubq_u8(acc, m);
+        }
+        count += horizontal_sum_neon(acc);
+    }
+    return count + count_changed_gray_scalar(a + i, b + i, n - i, threshold);
+}
+
+static size_t count_changed_rgb_neon(const unsigned char* a, const unsigned char* b, size_t pixels, int threshold) {
+    const uint8x16_t limit = vdupq_n_u8((uint8_t)threshold);
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 16 <= pixels) {
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (int block = 0; block < 255 && i + 16 <= pixels; block++, i += 16) {
+            uint8x16x3_t va = vld3q_u8(a + i * 3);
+            uint8x16x3_t vb = vld3q_u8(b + i * 3);
+            uint8x16_t m = vorrq_u8(vorrq_u8(vcgtq_u8(vabdq_u8(va.val[0], vb.val[0]), limit),
+                                             vcgtq_u8(vabdq_u8(va.val[1], vb.val[1]), limit)),
+                                    vcgtq_u8(vabdq_u8(va.val[2], vb.val[2]), limit));
+            acc = vsubq_u8(acc, m);
+        }
+        count += horizontal_sum_neon(acc);
+    }
+    return count + count_changed_rgb_scalar(a + i * 3, b + i * 3, pixels - i, threshold);
+}
+#endif
+
+struct DiffKernels {
+    const char* name;
+    size_t (*count_gray)(const unsigned char* a, const unsigned char* b, size_t n, int threshold);
+    size_t (*count_rgb)(const unsigned char* a, const unsigned char* b, size_t pixels, int threshold);
+};
+
+// Pick the fastest kernels supported by this CPU (detected once)
+const DiffKernels& select_diff_kernels(bool use_simd) {
+    static const DiffKernels scalar = { "scalar", count_changed_gray_scalar, count_changed_rgb_scalar };
+    if (!use_simd) return scalar;
+    
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    static const DiffKernels neon = { "neon", count_changed_gray_neon, count_changed_rgb_neon };
+    return neon;
+#else
+#if defined(MOTION_HAVE_AVX2)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+#if defined(__SSE2__)
+    static const DiffKernels avx2 = { "avx2", count_changed_gray_avx2, count_changed_rgb_sse2 };
+#else
+    static const DiffKernels avx2 = { "avx2", count_changed_gray_avx2, count_changed_rgb_scalar };
+#endif
+    if (has_avx2) return avx2;
+#endif
+#if defined(__SSE2__)
+    static const DiffKernels sse2 = { "sse2", count_changed_gray_sse2, count_changed_rgb_sse2 };
+    return sse2;
+#else
+    return scalar;
+#endif
+#endif
+}
+
+// Count changed pixels in a run of interleaved pixels (any channel over threshold)
+size_t count_changed_pixels(const unsigned char* a, const unsigned char* b, size_t pixels, int channels,
+                            int threshold, const DiffKernels& kernels) {
+    if (threshold < 0) return pixels;      // Every difference (including 0) exceeds the threshold
+    if (threshold >= 255) return 0;        // No 8-bit difference can exceed it
+    
+    if (channels == 1) return kernels.count_gray(a, b, pixels, threshold);
+    if (channels == 3) return kernels.count_rgb(a, b, pixels, threshold);
+    
+    size_t count = 0;
+    for (size_t i = 0; i < pixels; i++) {
+        const unsigned char* pa = a + i * channels;
+        const unsigned char* pb = b + i * channels;
+        for (int c = 0; c < channels; c++) {
+            if (abs((int)pa[c] - (int)pb[c]) > threshold) {
+                count++;
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+// Count pixels whose (r+g+b)/3 average changed (grayscale mode on 3-channel buffers)
+size_t count_changed_pixels_avg(const unsigned char* a, const unsigned char* b, size_t pixels, int channels,
+                                int threshold) {
+    size_t count = 0;
+    for (size_t i = 0; i < pixels; i++) {
+        size_t idx = i * channels;
+        int gray1 = (a[idx] + a[idx+1] + a[idx+2]) / 3;
+        int gray2 = (b[idx] + b[idx+1] + b[idx+2]) / 3;
+        count += abs(gray1 - gray2) > threshold;
+    }
+    return count;
+}
+
+// Persistent worker pool for stripe processing.
+// run(tasks, fn) calls fn(0..tasks-1) on the workers plus the calling thread and waits for completion.
+class StripePool {
+public:
+    explicit StripePool(int threads) {
+        for (int i = 1; i < threads; i++) {
+            workers_.emplace_back([this] { worker_loop(); });
+        }
+    }
+    
+    ~StripePool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_) worker.join();
+    }
+    
+    int size() const { return (int)workers_.size() + 1; }
+    
+    void run(int tasks, const std::function<void(int)>& fn) {
+        if (workers_.empty() || tasks <= 1) {
+            for (int i = 0; i < tasks; i++) fn(i);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &fn;
+            tasks_ = tasks;
+            next_task_ = 0;
+            pending_ = tasks;
+            generation_++;
+        }
+        wake_.notify_all();
+        work();
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+        job_ = nullptr;
+    }
+    
+private:
+    // Claim and run tasks of the current job until none are left
+    void work() {
+        for (;;) {
+            const std::function<void(int)>* job;
+            int task;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!job_ || next_task_ >= tasks_) return;
+                job = job_;
+                task = next_task_++;
+            }
+            (*job)(task);
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0) done_.notify_all();
+        }
+    }
+    
+    void worker_loop() {
+        unsigned seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+            }
+            work();
+        }
+    }
+    
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_, done_;
+    const std::function<void(int)>* job_ = nullptr;
+    int tasks_ = 0;
+    int next_task_ = 0;
+    int pending_ = 0;
+    unsigned generation_ = 0;
+    bool stop_ = false;
+};
+
+// Resolve -j: 0 means one thread per core
+int resolve_thread_count(int requested) {
+    if (requested > 0) return requested;
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores > 0 ? (int)cores : 1;
+}
+
+// Shared pool, created on first use and kept for the lifetime of the process (streaming reuses it)
+StripePool& stripe_pool(int threads) {
+    static std::unique_ptr<StripePool> pool;
+    threads = resolve_thread_count(threads);
+    if (!pool || pool->size() != threads) pool.reset(new StripePool(threads));
+    return *pool;
+}
+
+// Rows per stripe below which splitting is not worth the synchronisation
+static const int MIN_STRIPE_ROWS = 16;
+
+// ---------------------------------------------------------------------------
+// Region-of-interest mask
+// The mask is compiled once per frame size into run-length spans of active
+// pixels, so the diff loop only visits pixels that matter.
+// ---------------------------------------------------------------------------
+
+struct MaskSpan {
+    int x0, x1;  // Active pixels [x0, x1) of a row
+};
+
+struct MotionMask {
+    int width = 0;
+    int height = 0;
+    int scale_denom = 1;
+    std::vector<MaskSpan> spans;      // All spans, row by row
+    std::vector<size_t> row_start;    // Spans of row y are [row_start[y], row_start[y + 1])
+    size_t active_pixels = 0;
+};
+
+// Load a binary PGM (P5, 8-bit) mask: nonzero pixels are active
+bool load_pgm_mask(const char* filename, MaskSpec& spec) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) return false;
+    
+    // Header fields are separated by whitespace and may be interleaved with # comments
+    auto read_field = [f](int& value) {
+        int c = fgetc(f);
+        while (c != EOF && (isspace(c) || c == '#')) {
+            if (c == '#') while (c != EOF && c != '\n') c = fgetc(f);
+            c = fgetc(f);
+        }
+        if (c == EOF) return false;
+        ungetc(c, f);
+        return fscanf(f, "%d", &value) == 1;
+    };
+    
+    int width = 0, height = 0, maxval = 0;
+    bool ok = fgetc(f) == 'P' && fgetc(f) == '5' &&
+              read_field(width) && read_field(height) && read_field(maxval) &&
+              width > 0 && height > 0 && maxval > 0 && maxval < 256 && isspace(fgetc(f));
+    if (ok) {
+        spec.pgm.resize((size_t)width * height);
+        ok = fread(spec.pgm.data(), 1, spec.pgm.size(), f) == spec.pgm.size();
+        spec.pgm_width = width;
+        spec.pgm_height = height;
+    }
+    fclose(f);
+    if (!ok) spec.pgm.clear();
+    return ok;
+}
+
+// Parse "x,y,w,h"
+bool parse_rect(const char* text, MaskRect& rect) {
+    return sscanf(text, "%d,%d,%d,%d", &rect.x, &rect.y, &rect.width, &rect.height) == 4 &&
+           rect.width > 0 && rect.height > 0;
+}
+
+// Compile the mask for a decoded frame. PGM masks of a different size are
+// stretched to the frame; ignore rectangles are in source pixels and divided
+// by the decode scale. origin_x/y is the frame's top-left corner in decoded
+// pixels (non-zero when only an ROI was decoded).
+void compile_motion_mask(const MaskSpec& spec, int width, int height, int scale_denom, MotionMask& mask,
+                         int origin_x = 0, int origin_y = 0) {
+    mask.width = width;
+    mask.height = height;
+    mask.scale_denom = scale_denom;
+    mask.spans.clear();
+    mask.row_start.assign(1, 0);
+    mask.active_pixels = 0;
+    
+    std::vector<unsigned char> row(width);
+    for (int y = 0; y < height; y++) {
+        if (spec.pgm.empty()) {
+            std::fill(row.begin(), row.end(), 1);
+        } else {
+            const unsigned char* src = &spec.pgm[(size_t)((int64_t)y * spec.pgm_height / height) * spec.pgm_width];
+            for (int x = 0; x < width; x++) {
+                row[x] = src[(int64_t)x * spec.pgm_width / width] != 0;
+            }
+        }
+        
+        for (const MaskRect& r : spec.ignore) {
+            int y0 = r.y / scale_denom - origin_y;
+            int y1 = (r.y + r.height + scale_denom - 1) / scale_denom - origin_y;
+            if (y < y0 || y >= y1) continue;
+            int x0 = std::max(0, r.x / scale_denom - origin_x);
+            int x1 = std::min(width, (r.x + r.width + scale_denom - 1) / scale_denom - origin_x);
+            if (x0 < x1) std::fill(row.begin() + x0, row.begin() + x1, 0);
+        }
+        
+        for (int x = 0; x < width;) {
+            if (!row[x]) { x++; continue; }
+            int x0 = x;
+            while (x < width && row[x]) x++;
+            mask.spans.push_back({ x0, x });
+            mask.active_pixels += x - x0;
+        }
+        mask.row_start.push_back(mask.spans.size());
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Motion grid
+// The frame is divided into cols x rows tiles and changed pixels are counted
+// per tile during the normal diff pass, so downstream zone logic can see where
+// the motion is without decoding the frames again.
+// ---------------------------------------------------------------------------
+
+struct MotionGrid {
+    int cols = 0;
+    int rows = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<size_t> active;      // Analysed pixels per tile (row-major)
+    std::vector<size_t> changed;     // Changed pixels per tile
+    
+    // Tile column c covers x in [c * width / cols, (c + 1) * width / cols), likewise for rows
+    int column_start(int c) const { return (int)((int64_t)c * width / cols); }
+    int column_of(int x) const { return (int)(((int64_t)x + 1) * cols - 1) / width; }
+    int row_of(int y) const { return (int)(((int64_t)y + 1) * rows - 1) / height; }
+    
+    float percentage(size_t tile) const { return active[tile] > 0 ? (float)changed[tile] / active[tile] * 100.0f : 0.0f; }
+};
+
+// Set up an empty grid for a width x height frame; tiles are at least one pixel
+void init_motion_grid(MotionGrid& grid, int cols, int rows, int width, int height, const MotionMask* mask) {
+    grid.cols = std::max(1, std::min(cols, width));
+    grid.rows = std::max(1, std::min(rows, height));
+    grid.width = width;
+    grid.height = height;
+    grid.active.assign((size_t)grid.cols * grid.rows, 0);
+    grid.changed.assign((size_t)grid.cols * grid.rows, 0);
+    
+    for (int y = 0; y < height; y++) {
+        size_t* tiles = &grid.active[(size_t)grid.row_of(y) * grid.cols];
+        if (!mask) {
+            for (int c = 0; c < grid.cols; c++) tiles[c] += grid.column_start(c + 1) - grid.column_start(c);
+            continue;
+        }
+        for (size_t i = mask->row_start[y]; i < mask->row_start[y + 1]; i++) {
+            for (int x = mask->spans[i].x0; x < mask->spans[i].x1;) {
+                int c = grid.column_of(x);
+                int end = std::min(mask->spans[i].x1, grid.column_start(c + 1));
+                tiles[c] += end - x;
+                x = end;
+            }
+        }
+    }
+}
+
+// Count changed pixels of one row, restricted to the mask spans of row y if a mask is given.
+// With a grid the row is split at the tile columns and each piece is also added to
+// tile_counts, the counters of the tile row containing y.
+size_t count_changed_row(const unsigned char* row1, const unsigned char* row2, int y, int width, int channels,
+                         bool average_gray, int threshold, const DiffKernels& kernels,
+                         const MotionMask* mask = nullptr, const MotionGrid* grid = nullptr,
+                         size_t* tile_counts = nullptr) {
+    auto count_run = [&](int x0, int pixels) {
+        size_t offset = (size_t)x0 * channels;
+        if (average_gray) return count_changed_pixels_avg(row1 + offset, row2 + offset, pixels, channels, threshold);
+        return count_changed_pixels(row1 + offset, row2 + offset, pixels, channels, threshold, kernels);
+    };
+    auto count_span = [&](int x0, int x1) {
+        if (!grid) return count_run(x0, x1 - x0);
+        size_t count = 0;
+        for (int c = grid->column_of(x0); x0 < x1; c++) {
+            int end = std::min(x1, grid->column_start(c + 1));
+            size_t changed = count_run(x0, end - x0);
+            tile_counts[c] += changed;
+            count += changed;
+            x0 = end;
+        }
+        return count;
+    };
+    if (!mask) return count_span(0, width);
+    
+    size_t count = 0;
+    for (size_t i = mask->row_start[y]; i < mask->row_start[y + 1]; i++) {
+        count += count_span(mask->spans[i].x0, mask->spans[i].x1);
+    }
+    return count;
+}
+
+// ---------------------------------------------------------------------------
+// Decision-only scanning
+// When only the yes/no answer against motion_threshold matters, stripes report
+// their progress in chunks and every stripe stops once enough pixels changed
+// or the unscanned pixels can no longer reach the threshold.
+// ---------------------------------------------------------------------------
+
+static const int DECISION_CHUNK_ROWS = 16;
+
+class EarlyExit {
+public:
+    EarlyExit(size_t total_pixels, float motion_threshold)
+        : total_(total_pixels), remaining_(total_pixels) {
+        // Smallest count whose percentage (computed exactly like the full scan) reaches the threshold
+        needed_ = (size_t)std::max(0.0, std::ceil((double)motion_threshold * total_pixels / 100.0));
+        while (needed_ > 0 && percentage(needed_ - 1) >= motion_threshold) needed_--;
+        while (needed_ <= total_ && percentage(needed_) < motion_threshold) needed_++;
+        if (needed_ == 0 || needed_ > total_) done_ = true;   // Decided before scanning anything
+    }
+    
+    // Record a scanned chunk; returns true once the outcome is known
+    bool add(size_t changed, size_t scanned) {
+        size_t found = changed_ += changed;
+        size_t left = remaining_ -= scanned;
+        if (found >= needed_ || found + left < needed_) done_ = true;
+        return done_;
+    }
+    
+    bool decided() const { return done_; }
+    
+    // Lower bound on the motion percentage if the threshold was reached, otherwise an upper bound
+    float result() const {
+        size_t found = changed_;
+        return percentage(found >= needed_ ? found : std::min(total_, found + remaining_));
+    }
+    
+private:
+    float percentage(size_t pixels) const {
+        return total_ > 0 ? (float)pixels / total_ * 100.0f : 0.0f;
+    }
+    
+    size_t total_;
+    size_t needed_;
+    std::atomic<size_t> changed_{0};
+    std::atomic<size_t> remaining_;
+    std::atomic<bool> done_{false};
+};
+
+// ---------------------------------------------------------------------------
+// Block-mean comparison
+// Both frames are reduced to the mean of each NxN cell in one pass over the
+// rows (16-bit column sums, folded into block sums once per block row) and
+// the means are compared instead of pixels. A changed block counts
+// with its pixel area (its active area when a mask is set), so the result is
+// still a percentage of the frame.
+// ---------------------------------------------------------------------------
+
+// Add a row of bytes to 16-bit column sums (a block of up to 256 rows cannot overflow)
+static void accumulate_columns(const unsigned char* row, uint16_t* sums, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i* s = (__m128i*)(sums + i);
+        _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(v, zero)));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(row + i);
+        vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), vget_low_u8(v)));
+        vst1q_u16(sums + i + 8, vaddw_u8(vld1q_u16(sums + i + 8), vget_high_u8(v)));
+    }
+#endif
+    for (; i < n; i++) sums[i] += row[i];
+}
+
+// Reduce the column sums of a finished block row to per-block sums (sum_channels values per block).
+// With sum_average the channels of each pixel are added together (r+g+b grayscale average).
+static void reduce_block_columns(const uint16_t* columns, int width, int row_channels, bool sum_average,
+                                 int block, uint32_t* sums) {
+    int sum_channels = sum_average ? 1 : row_channels;
+    for (int x0 = 0, bx = 0; x0 < width; x0 += block, bx++) {
+        int bw = std::min(block, width - x0);
+        const uint16_t* col = columns + (size_t)x0 * row_channels;
+        uint32_t* s = sums + (size_t)bx * sum_channels;
+        if (sum_channels == 1) {
+            uint32_t sum = 0;
+            for (int i = 0; i < bw * row_channels; i++) sum += col[i];
+            s[0] = sum;
+            continue;
+        }
+        for (int c = 0; c < sum_channels; c++) s[c] = 0;
+        for (int x = 0; x < bw; x++) {
+            for (int c = 0; c < row_channels; c++) s[c] += col[x * row_channels + c];
+        }
+    }
+}
+
+float calculate_motion_blocks(const unsigned char* img1, const unsigned char* img2,
+                              int width, int height, int channels,
+                              const MotionDetectionParams& params, const MotionMask* mask = nullptr,
+                              EarlyExit* early = nullptr) {
+    int block = params.block_size;
+    int cols = (width + block - 1) / block;
+    int rows = (height + block - 1) / block;
+    size_t total_pixels = mask ? mask->active_pixels : (size_t)width * height;
+    
+    bool average_gray = !params.use_rgb && channels >= 3;
+    int row_channels = params.enable_blur && average_gray ? 1 : channels;   // RowBlur emits gray rows
+    bool sum_average = average_gray && row_channels >= 3;
+    int sum_channels = sum_average ? 1 : row_channels;
+    int values_per_pixel = sum_average ? 3 : 1;
+    
+    StripePool& pool = stripe_pool(params.threads);
+    int stripes = std::max(1, std::min(pool.size(), rows));
+    std::vector<size_t> stripe_counts(stripes, 0);
+    
+    pool.run(stripes, [&](int stripe) {
+        int by0 = (int)((int64_t)rows * stripe / stripes);
+        int by1 = (int)((int64_t)rows * (stripe + 1) / stripes);
+        std::unique_ptr<RowBlur> blur1, blur2;
+        if (params.enable_blur) {
+            blur1.reset(new RowBlur(img1, width, height, channels, params.use_rgb, params.blur_radius, params.blur_passes));
+            blur2.reset(new RowBlur(img2, width, height, channels, params.use_rgb, params.blur_radius, params.blur_passes));
+        }
+        
+        std::vector<uint16_t> columns1((size_t)width * row_channels), columns2(columns1.size());
+        std::vector<uint32_t> sums1((size_t)cols * sum_channels), sums2(sums1.size());
+        std::vector<uint32_t> active(cols);
+        size_t count = 0;
+        for (int by = by0; by < by1; by++) {
+            if (early && early->decided()) break;
+            int y0 = by * block;
+            int y1 = std::min(height, y0 + block);
+            size_t block_row_changed = 0, block_row_pixels = 0;
+            std::fill(columns1.begin(), columns1.end(), 0);
+            std::fill(columns2.begin(), columns2.end(), 0);
+            std::fill(active.begin(), active.end(), 0);
+            
+            for (int y = y0; y < y1; y++) {
+                const unsigned char* row1 = blur1 ? blur1->row(y) : img1 + (size_t)y * width * channels;
+                const unsigned char* row2 = blur2 ? blur2->row(y) : img2 + (size_t)y * width * channels;
+                accumulate_columns(row1, columns1.data(), columns1.size());
+                accumulate_columns(row2, columns2.data(), columns2.size());
+                
+                if (mask) {
+                    // Active pixels of each block, split from the row's spans
+                    for (size_t i = mask->row_start[y]; i < mask->row_start[y + 1]; i++) {
+                        for (int x = mask->spans[i].x0; x < mask->spans[i].x1;) {
+                            int end = std::min(mask->spans[i].x1, (x / block + 1) * block);
+                            active[x / block] += end - x;
+                            x = end;
+                        }
+                    }
+                }
+            }
+            
+            reduce_block_columns(columns1.data(), width, row_channels, sum_average, block, sums1.data());
+            reduce_block_columns(columns2.data(), width, row_channels, sum_average, block, sums2.data());
+            for (int bx = 0; bx < cols; bx++) {
+                uint32_t pixels = (uint32_t)(std::min(block, width - bx * block) * (y1 - y0));
+                uint32_t weight = mask ? active[bx] : pixels;
+                if (weight == 0) continue;
+                block_row_pixels += weight;
+                
+                // Rounded means; any channel over threshold marks the block as changed
+                uint32_t divisor = pixels * values_per_pixel;
+                bool changed = false;
+                for (int c = 0; c < sum_channels; c++) {
+                    int mean1 = (int)((sums1[(size_t)bx * sum_channels + c] + divisor / 2) / divisor);
+                    int mean2 = (int)((sums2[(size_t)bx * sum_channels + c] + divisor / 2) / divisor);
+                    changed |= abs(mean1 - mean2) > params.pixel_threshold;
+                }
+                if (changed) block_row_changed += weight;
+            }
+            count += block_row_changed;
+            if (early && early->add(block_row_changed, block_row_pixels)) break;
+        }
+        stripe_counts[stripe] = count;
+    });
+    
+    if (early && early->decided()) return early->result();
+    
+    size_t motion_pixels = 0;
+    for (size_t count : stripe_counts) motion_pixels += count;
+    
+    return total_pixels > 0 ? (float)motion_pixels / total_pixels * 100.0f : 0.0f;
+}
+
+// ---------------------------------------------------------------------------
+// Sampled comparison
+// Only one pixel per step x step cell is compared, either at the cell centre
+// (lattice) or at a random position (stratified: one random row per band of
+// cells, a random column in each cell). Samples are grouped into few rows so
+// the decoder can skip the rows in between. The motion percentage is then an
+// estimate with a Wilson score confidence interval.
+// ---------------------------------------------------------------------------
+
+struct SampleEstimate {
+    size_t samples = 0;     // Compared (active) pixels
+    size_t changed = 0;
+    float low = 0.0f;       // 95% confidence interval of the motion percentage
+    float high = 0.0f;
+};
+
+class SamplePlan {
+public:
+    SamplePlan(int width, int height, size_t budget, bool random) {
+        step_ = std::max(1, (int)std::sqrt((double)width * height / std::max<size_t>(1, budget)));
+        int cells_per_row = (width + step_ - 1) / step_;
+        uint32_t state = 0x9E3779B9u;   // Fixed seed: the same pixels are sampled in every frame
+        auto next_random = [&state](int range) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return (int)(state % (uint32_t)range);
+        };
+        
+        for (int y0 = 0; y0 < height; y0 += step_) {
+            int band_height = std::min(step_, height - y0);
+            rows_.push_back(y0 + (random ? next_random(band_height) : band_height / 2));
+            for (int i = 0; i < cells_per_row; i++) {
+                int x0 = i * step_;
+                int cell_width = std::min(step_, width - x0);
+                columns_.push_back(x0 + (random ? next_random(cell_width) : cell_width / 2));
+            }
+        }
+        columns_per_row_ = cells_per_row;
+    }
+    
+    size_t bands() const { return rows_.size(); }
+    int row(size_t band) const { return rows_[band]; }
+    const int* columns(size_t band) const { return &columns_[band * columns_per_row_]; }
+    size_t columns_per_row() const { return columns_per_row_; }
+    int step() const { return step_; }
+    
+private:
+    int step_;
+    size_t columns_per_row_ = 0;
+    std::vector<int> rows_;
+    std::vector<int> columns_;  // Sampled columns of each band (ascending)
+};
+
+// Compare the sampled columns of row y; adds the number of compared (active) samples to *samples
+size_t count_sampled_row(const unsigned char* row1, const unsigned char* row2, int y,
+                         const int* columns, size_t count, int channels, bool average_gray, int threshold,
+                         const MotionMask* mask, size_t* samples) {
+    size_t changed = 0;
+    size_t span = mask ? mask->row_start[y] : 0;
+    size_t span_end = mask ? mask->row_start[y + 1] : 0;
+    for (size_t i = 0; i < count; i++) {
+        int x = columns[i];
+        if (mask) {
+            // Columns are ascending, so the spans are walked once
+            while (span < span_end && mask->spans[span].x1 <= x) span++;
+            if (span == span_end || mask->spans[span].x0 > x) continue;
+        }
+        const unsigned char* p1 = row1 + (size_t)x * channels;
+        const unsigned char* p2 = row2 + (size_t)x * channels;
+        bool pixel_changed = false;
+        if (average_gray) {
+            pixel_changed = abs((p1[0] + p1[1] + p1[2]) / 3 - (p2[0] + p2[1] + p2[2]) / 3) > threshold;
+        } else {
+            for (int c = 0; c < channels && !pixel_changed; c++) pixel_changed = abs((int)p1[c] - (int)p2[c]) > threshold;
+        }
+        changed += pixel_changed;
+        (*samples)++;
+    }
+    return changed;
+}
+
+// Motion percentage estimate and its 95% Wilson score interval
+float finish_sample_estimate(SampleEstimate& estimate) {
+    if (estimate.samples == 0) return 0.0f;
+    const double z = 1.96;
+    double n = (double)estimate.samples;
+    double p = estimate.changed / n;
+    double denominator = 1.0 + z * z / n;
+    double center = (p + z * z / (2.0 * n)) / denominator;
+    double half = z * std::sqrt(p * (1.0 - p) / n + z * z / (4.0 * n * n)) / denominator;
+    estimate.low = (float)(std::max(0.0, center - half) * 100.0);
+    estimate.high = (float)(std::min(1.0, center + half) * 100.0);
+    return (float)(p * 100.0);
+}
+
+float calculate_motion_sampled(const unsigned char* img1, const unsigned char* img2,
+                               int width, int height, int channels,
+                               const MotionDetectionParams& params, const MotionMask* mask,
+                               SampleEstimate* estimate) {
+    SamplePlan plan(width, height, params.sample_budget, params.sample_random);
+    SampleEstimate local;
+    SampleEstimate& result = estimate ? *estimate : local;
+    result = SampleEstimate();
+    
+    // Blur needs every row of its window, but only the sampled rows are compared
+    std::unique_ptr<RowBlur> blur1, blur2;
+    if (params.enable_blur) {
+        blur1.reset(new RowBlur(img1, width, height, channels, params.use_rgb, params.blur_radius, params.blur_passes));
+        blur2.reset(new RowBlur(img2, width, height, channels, params.use_rgb, params.blur_radius, params.blur_passes));
+    }
+    int row_channels = blur1 ? blur1->channels() : channels;
+    bool average_gray = !blur1 && !params.use_rgb && channels >= 3;
+    
+    for (size_t band = 0; band < plan.bands(); band++) {
+        int y = plan.row(band);
+        const unsigned char* row1 = blur1 ? blur1->row(y) : img1 + (size_t)y * width * channels;
+        const unsigned char* row2 = blur2 ? blur2->row(y) : img2 + (size_t)y * width * channels;
+        result.changed += count_sampled_row(row1, row2, y, plan.columns(band), plan.columns_per_row(), row_channels,
+                                            average_gray, params.pixel_threshold, mask, &result.samples);
+    }
+    return finish_sample_estimate(result);
+}
+
+// Calculate motion on already-scaled images (no pixel skipping needed!)
+// With params.decision_only the scan may stop early; *stopped_early is then set and the result is
+// only a bound (at least the threshold when motion was found, below it otherwise).
+// With params.sample_budget the result is an estimate, detailed in *estimate.
+float calculate_motion_scaled(const unsigned char* img1, const unsigned char* img2,
+                              int width, int height, int channels,
+                              const MotionDetectionParams& params, const MotionMask* mask = nullptr,
+                              bool* stopped_early = nullptr, SampleEstimate* estimate = nullptr,
+                              MotionGrid* grid = nullptr) {
+    if (stopped_early) *stopped_early = false;
+    if (!img1 || !img2 || width <= 0 || height <= 0 || channels <= 0) {
+        return 0.0f;
+    }
+    
+    if (mask && (mask->width != width || mask->height != height)) mask = nullptr;
+    if (params.sample_budget > 0) {
+        return calculate_motion_sampled(img1, img2, width, height, channels, params, mask, estimate);
+    }
+    if (params.grid_cols <= 0) grid = nullptr;
+    if (grid) init_motion_grid(*grid, params.grid_cols, params.grid_rows, width, height, mask);
+    size_t total_pixels = mask ? mask->active_pixels : (size_t)width * height;
+    
+    std::unique_ptr<EarlyExit> early;
+    if (params.decision_only) early.reset(new EarlyExit(total_pixels, params.motion_threshold));
+    
+    if (params.block_size > 1) {
+        float result = calculate_motion_blocks(img1, img2, width, height, channels, params, mask, early.get());
+        if (stopped_early && early) *stopped_early = early->decided();
+        return result;
+    }
+    
+    // Split the frame into horizontal stripes, one counter per stripe, reduced at the end
+    StripePool& pool = stripe_pool(params.threads);
+    int stripes = std::max(1, std::min(pool.size(), height / MIN_STRIPE_ROWS));
+    std::vector<size_t> stripe_counts(stripes, 0);
+    std::vector<std::vector<size_t>> stripe_tiles(grid ? stripes : 0, std::vector<size_t>(grid ? grid->changed.size() : 0));
+    const DiffKernels& kernels = select_diff_kernels(params.use_simd);
+    bool average_gray = !params.use_rgb && channels >= 3;
+    
+    // Count changed pixels in a run of pixels starting at byte offset
+    auto count_run = [&](size_t offset, size_t pixels) {
+        if (average_gray) {
+            // Convert to grayscale and compare
+            return count_changed_pixels_avg(img1 + offset, img2 + offset, pixels, channels, params.pixel_threshold);
+        }
+        // Compare all channels
+        return count_changed_pixels(img1 + offset, img2 + offset, pixels, channels, params.pixel_threshold, kernels);
+    };
+    
+    // Count changed pixels of one (blurred) row, restricted to the mask spans, into the stripe's tiles
+    auto count_row = [&](const unsigned char* row1, const unsigned char* row2, int y, int row_channels,
+                         bool row_average_gray, int stripe) {
+        size_t* tile_counts = grid ? &stripe_tiles[stripe][(size_t)grid->row_of(y) * grid->cols] : nullptr;
+        return count_changed_row(row1, row2, y, width, row_channels, row_average_gray, params.pixel_threshold,
+                                 kernels, mask, grid, tile_counts);
+    };
+    
+    // Pixels of rows [y0, y1) that are compared
+    auto rows_pixels = [&](int y0, int y1) {
+        if (!mask) return (size_t)(y1 - y0) * width;
+        size_t pixels = 0;
+        for (size_t i = mask->row_start[y0]; i < mask->row_start[y1]; i++) {
+            pixels += mask->spans[i].x1 - mask->spans[i].x0;
+        }
+        return pixels;
+    };
+    
+    // Process all pixels (no skipping needed since we scaled during decode!)
+    pool.run(stripes, [&](int stripe) {
+        int y0 = (int)((int64_t)height * stripe / stripes);
+        int y1 = (int)((int64_t)height * (stripe + 1) / stripes);
+        
+        // Fused blur + diff: each row of both images is blurred from a rolling window and
+        // compared immediately while it is still in cache
+        std::unique_ptr<RowBlur> blur1, blur2;
+        if (params.enable_blur) {
+            blur1.reset(new RowBlur(img1, width, height, channels, params.use_rgb, params.blur_radius, params.blur_passes));
+            blur2.reset(new RowBlur(img2, width, height, channels, params.use_rgb, params.blur_radius, params.blur_passes));
+        }
+        
+        // Count changed pixels of rows [chunk0, chunk1)
+        auto count_rows = [&](int chunk0, int chunk1) {
+            size_t count = 0;
+            if (blur1) {
+                for (int y = chunk0; y < chunk1; y++) {
+                    count += count_row(blur1->row(y), blur2->row(y), y, blur1->channels(), false, stripe);
+                }
+            } else if (grid) {
+                size_t stride = (size_t)width * channels;
+                for (int y = chunk0; y < chunk1; y++) {
+                    count += count_row(img1 + y * stride, img2 + y * stride, y, channels, average_gray, stripe);
+                }
+            } else if (!mask) {
+                count = count_run((size_t)chunk0 * width * channels, (size_t)(chunk1 - chunk0) * width);
+            } else {
+                // Masked: only visit the active spans of each row
+                for (int y = chunk0; y < chunk1; y++) {
+                    size_t row_offset = (size_t)y * width;
+                    for (size_t i = mask->row_start[y]; i < mask->row_start[y + 1]; i++) {
+                        const MaskSpan& span = mask->spans[i];
+                        count += count_run((row_offset + span.x0) * channels, span.x1 - span.x0);
+                    }
+                }
+            }
+            return count;
+        };
+        
+        if (!early) {
+            stripe_counts[stripe] = count_rows(y0, y1);
+            return;
+        }
+        
+        // Decision only: report progress every few rows and stop once the outcome is known
+        size_t count = 0;
+        for (int y = y0; y < y1 && !early->decided(); y += DECISION_CHUNK_ROWS) {
+            int y_end = std::min(y1, y + DECISION_CHUNK_ROWS);
+            size_t changed = count_rows(y, y_end);
+            count += changed;
+            if (early->add(changed, rows_pixels(y, y_end))) break;
+        }
+        stripe_counts[stripe] = count;
+    });
+    
+    if (early && early->decided()) {
+        if (stopped_early) *stopped_early = true;
+        return early->result();
+    }
+    
+    size_t motion_pixels = 0;
+    for (size_t count : stripe_counts) motion_pixels += count;
+    for (const std::vector<size_t>& tiles : stripe_tiles) {
+        for (size_t i = 0; i < tiles.size(); i++) grid->changed[i] += tiles[i];
+    }
+    
+    return total_pixels > 0 ? (float)motion_pixels / total_pixels * 100.0f : 0.0f;
+}
+
+// ---------------------------------------------------------------------------
+// Background model
+// With --background k a stream compares every frame with a per-pixel
+// exponential running average (alpha = 1/2^k) instead of the previous frame.
+// The model is kept in 8.8 fixed point. Each row is blended and compared in
+// one pass: the blend writes the rounded background of the row to a small
+// buffer, which the diff kernels compare with the frame row while both are
+// still in cache. SIMD variants are bit-exact with the scalar one.
+// ---------------------------------------------------------------------------
+
+// estimate = round(model / 256), then model += (frame * 256 - model) / 2^shift rounded down
+static void background_blend_scalar(const unsigned char* frame, uint16_t* model, unsigned char* estimate,
+                                    size_t n, int shift) {
+    for (size_t i = 0; i < n; i++) {
+        int value = frame[i] << 8;
+        int current = model[i];
+        estimate[i] = (unsigned char)((current + 128) >> 8);
+        model[i] = (uint16_t)(value >= current ? current + ((value - current) >> shift)
+                                               : current - ((current - value + (1 << shift) - 1) >> shift));
+    }
+}
+
+#if defined(__SSE2__)
+// Values are at most 255 << 8, so (model - value) + bias cannot exceed 65535
+static inline __m128i background_blend_u16_sse2(__m128i model, __m128i value, __m128i shift, __m128i bias) {
+    __m128i up = _mm_srl_epi16(_mm_subs_epu16(value, model), shift);
+    __m128i down = _mm_srl_epi16(_mm_add_epi16(_mm_subs_epu16(model, value), bias), shift);
+    return _mm_sub_epi16(_mm_add_epi16(model, up), down);
+}
+
+static void background_blend_sse2(const unsigned char* frame, uint16_t* model, unsigned char* estimate,
+                                  size_t n, int shift) {
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m128i bias = _mm_set1_epi16((short)((1 << shift) - 1));
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(frame + i));
+        __m128i m0 = _mm_loadu_si128((const __m128i*)(model + i));
+        __m128i m1 = _mm_loadu_si128((const __m128i*)(model + i + 8));
+        __m128i e = _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(m0, half), 8),
+                                     _mm_srli_epi16(_mm_add_epi16(m1, half), 8));
+        _mm_storeu_si128((__m128i*)(estimate + i), e);
+        // Interleaving with zero below each byte gives frame << 8
+        _mm_storeu_si128((__m128i*)(model + i),
+                         background_blend_u16_sse2(m0, _mm_unpacklo_epi8(zero, pixels), count, bias));
+        _mm_storeu_si128((__m128i*)(model + i + 8),
+                         background_blend_u16_sse2(m1, _mm_unpackhi_epi8(zero, pixels), count, bias));
+    }
+    background_blend_scalar(frame + i, model + i, estimate + i, n - i, shift);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline uint16x8_t background_blend_u16_neon(uint16x8_t model, uint16x8_t value, int16x8_t shift,
+                                                   uint16x8_t bias) {
+    uint16x8_t up = vshlq_u16(vqsubq_u16(value, model), shift);
+    uint16x8_t down = vshlq_u16(vaddq_u16(vqsubq_u16(model, value), bias), shift);
+    return vsubq_u16(vaddq_u16(model, up), down);
+}
+
+static void background_blend_neon(const unsigned char* frame, uint16_t* model, unsigned char* estimate,
+                                  size_t n, int shift) {
+    const int16x8_t count = vdupq_n_s16((int16_t)-shift);   // Negative: shift right
+    const uint16x8_t bias = vdupq_n_u16((uint16_t)((1 << shift) - 1));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t pixels = vld1q_u8(frame + i);
+        uint16x8_t m0 = vld1q_u16(model + i);
+        uint16x8_t m1 = vld1q_u16(model + i + 8);
+        vst1q_u8(estimate + i, vcombine_u8(vrshrn_n_u16(m0, 8), vrshrn_n_u16(m1, 8)));
+        vst1q_u16(model + i, background_blend_u16_neon(m0, vshll_n_u8(vget_low_u8(pixels), 8), count, bias));
+        vst1q_u16(model + i + 8, background_blend_u16_neon(m1, vshll_n_u8(vget_high_u8(pixels), 8), count, bias));
+    }
+    background_blend_scalar(frame + i, model + i, estimate + i, n - i, shift);
+}
+#endif
+
+typedef void (*BackgroundBlend)(const unsigned char* frame, uint16_t* model, unsigned char* estimate,
+                                size_t n, int shift);
+
+static BackgroundBlend select_background_blend(bool use_simd) {
+    if (!use_simd) return background_blend_scalar;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return background_blend_neon;
+#elif defined(__SSE2__)
+    return background_blend_sse2;
+#else
+    return background_blend_scalar;
+#endif
+}
+
+class BackgroundModel {
+public:
+    explicit BackgroundModel(const MotionDetectionParams& params) : params_(params) {}
+    
+    bool matches(int width, int height, int channels) const {
+        return !model_.empty() && width == width_ && height == height_ && channels == channels_;
+    }
+    
+    // Start a new model from this frame (first frame, or after a size change)
+    void reset(const unsigned char* img, int width, int height, int channels) {
+        width_ = width;
+        height_ = height;
+        channels_ = channels;
+        RowBlur blur(img, width, height, channels, params_.use_rgb, params_.blur_radius, params_.blur_passes);
+        model_channels_ = params_.enable_blur ? blur.channels() : channels;
+        size_t stride = (size_t)width * model_channels_;
+        model_.resize(stride * height);
+        for (int y = 0; y < height; y++) {
+            const unsigned char* row = params_.enable_blur ? blur.row(y) : img + (size_t)y * stride;
+            for (size_t i = 0; i < stride; i++) model_[(size_t)y * stride + i] = (uint16_t)(row[i] << 8);
+        }
+    }
+    
+    // Motion percentage of img against the background, which then absorbs img
+    float compare_and_update(const unsigned char* img, const MotionMask* mask, MotionGrid* grid) {
+        if (mask && (mask->width != width_ || mask->height != height_)) mask = nullptr;
+        if (params_.grid_cols <= 0) grid = nullptr;
+        if (grid) init_motion_grid(*grid, params_.grid_cols, params_.grid_rows, width_, height_, mask);
+        
+        StripePool& pool = stripe_pool(params_.threads);
+        int stripes = std::max(1, std::min(pool.size(), height_ / MIN_STRIPE_ROWS));
+        std::vector<size_t> stripe_counts(stripes, 0);
+        std::vector<std::vector<size_t>> stripe_tiles(grid ? stripes : 0,
+                                                      std::vector<size_t>(grid ? grid->changed.size() : 0));
+        const DiffKernels& kernels = select_diff_kernels(params_.use_simd);
+        BackgroundBlend blend = select_background_blend(params_.use_simd);
+        bool average_gray = !params_.enable_blur && !params_.use_rgb && channels_ >= 3;
+        size_t stride = (size_t)width_ * model_channels_;
+        
+        pool.run(stripes, [&](int stripe) {
+            int y0 = (int)((int64_t)height_ * stripe / stripes);
+            int y1 = (int)((int64_t)height_ * (stripe + 1) / stripes);
+            std::unique_ptr<RowBlur> blur;
+            if (params_.enable_blur) {
+                blur.reset(new RowBlur(img, width_, height_, channels_, params_.use_rgb, params_.blur_radius,
+                                       params_.blur_passes));
+            }
+            std::vector<unsigned char> estimate(stride);
+            size_t count = 0;
+            for (int y = y0; y < y1; y++) {
+                const unsigned char* row = blur ? blur->row(y) : img + (size_t)y * stride;
+                blend(row, &model_[(size_t)y * stride], estimate.data(), stride, params_.background_shift);
+                size_t* tile_counts = grid ? &stripe_tiles[stripe][(size_t)grid->row_of(y) * grid->cols] : nullptr;
+                count += count_changed_row(row, estimate.data(), y, width_, model_channels_, average_gray,
+                                           params_.pixel_threshold, kernels, mask, grid, tile_counts);
+            }
+            stripe_counts[stripe] = count;
+        });
+        
+        size_t motion_pixels = 0;
+        for (size_t count : stripe_counts) motion_pixels += count;
+        for (const std::vector<size_t>& tiles : stripe_tiles) {
+            for (size_t i = 0; i < tiles.size(); i++) grid->changed[i] += tiles[i];
+        }
+        size_t total_pixels = mask ? mask->active_pixels : (size_t)width_ * height_;
+        return total_pixels > 0 ? (float)motion_pixels / total_pixels * 100.0f : 0.0f;
+    }
+    
+private:
+    const MotionDetectionParams& params_;
+    int width_ = 0, height_ = 0, channels_ = 0;
+    int model_channels_ = 0;        // Channels of the (blurred) rows the model tracks
+    std::vector<uint16_t> model_;   // 8.8 fixed point background, row-major
+};
+
+// File size comparison
+float compare_file_sizes(const char* file1, const char* file2, const MotionDetectionParams& params) {
+    struct stat stat1, stat2;
+    
+    if (stat(file1, &stat1) != 0 || stat(file2, &stat2) != 0) {
+        return -1.0f; // Error
+    }
+    
+    if (stat1.st_size == 0 || stat2.st_size == 0) {
+        return -1.0f; // Invalid file
+    }
+    
+    float size_diff = abs((long)(stat1.st_size - stat2.st_size));
+    float avg_size = (stat1.st_size + stat2.st_size) / 2.0f;
+    float percentage = (size_diff / avg_size) * 100.0f;
+    
+    if (params.verbose) {
+        std::cout << "File sizes: " << stat1.st_size << " vs " << stat2.st_size 
+                  << " (diff: " << std::fixed << std::setprecision(1) << percentage << "%)" << std::endl;
+    }
+    
+    return percentage;
+}
+
+// ---------------------------------------------------------------------------
+// Coefficient-domain comparison
+// Both JPEGs are entropy-decoded to quantized luma DCT blocks and compared
+// block by block without an IDCT. JPEG's 8x8 DCT is orthonormal, so for the
+// dequantized coefficient difference dF of a block every pixel difference is
+// bounded by sum |dF(u,v)| * peak(u) * peak(v) and by sqrt(sum dF^2). Blocks
+// that are identical or under the threshold by either bound are static;
+// blocks whose DC shift outweighs all AC terms changed everywhere. Only the
+// remaining (ambiguous) blocks are reconstructed and compared pixel by pixel.
+// ---------------------------------------------------------------------------
+
+// Quantized luma coefficients of one JPEG. The blocks stay in the decoder's coefficient
+// arrays (no copy), so the decoder lives as long as the frame.
+struct CoefficientFrame {
+    int width = 0;                      // Image size in pixels
+    int height = 0;
+    int blocks_wide = 0;                // Luma blocks per row / column
+    int blocks_high = 0;
+    uint16_t quant[DCTSIZE2];           // Luma quantization table (natural order)
+    std::vector<const JCOEF*> rows;     // First coefficient of each block row
+    
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr_custom jerr;
+    bool created = false;
+    
+    CoefficientFrame() {}
+    CoefficientFrame(const CoefficientFrame&) = delete;
+    CoefficientFrame& operator=(const CoefficientFrame&) = delete;
+    ~CoefficientFrame() {
+        if (created) jpeg_destroy_decompress(&cinfo);
+    }
+};
+
+struct CoefficientStats {
+    size_t identical = 0;   // Byte-identical coefficient blocks
+    size_t bounded = 0;     // Different, but no pixel can exceed the threshold
+    size_t full = 0;        // Every pixel exceeds the threshold
+    size_t decoded = 0;     // Ambiguous: reconstructed and compared per pixel
+};
+
+// Read the luma DCT blocks of a JPEG (entropy decoding only)
+bool read_luma_coefficients(const char* filename, CoefficientFrame& frame, bool verbose) {
+    FILE* volatile infile = fopen(filename, "rb");
+    if (!infile) {
+        if (verbose) std::cerr << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+    
+    j_decompress_ptr cinfo = &frame.cinfo;
+    cinfo->err = jpeg_std_error(&frame.jerr.pub);
+    frame.jerr.pub.error_exit = jpeg_error_exit_custom;
+    
+    if (setjmp(frame.jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(cinfo);
+        frame.created = false;
+        if (infile) fclose(infile);
+        if (verbose) std::cerr << "JPEG error while reading coefficients" << std::endl;
+        return false;
+    }
+    
+    jpeg_create_decompress(cinfo);
+    frame.created = true;
+    jpeg_stdio_src(cinfo, infile);
+    jpeg_read_header(cinfo, TRUE);
+    jvirt_barray_ptr* arrays = jpeg_read_coefficients(cinfo);   // Consumes the whole file
+    fclose(infile);
+    infile = nullptr;
+    
+    // A luma block must cover exactly 8x8 image pixels
+    jpeg_component_info* luma = &cinfo->comp_info[0];
+    if (luma->h_samp_factor != cinfo->max_h_samp_factor || luma->v_samp_factor != cinfo->max_v_samp_factor ||
+        !luma->quant_table) {
+        if (verbose) std::cerr << "Unsupported component sampling for coefficient compare" << std::endl;
+        return false;
+    }
+    
+    frame.width = cinfo->image_width;
+    frame.height = cinfo->image_height;
+    frame.blocks_wide = luma->width_in_blocks;
+    frame.blocks_high = luma->height_in_blocks;
+    for (int k = 0; k < DCTSIZE2; k++) frame.quant[k] = luma->quant_table->quantval[k];
+    
+    // The arrays are fully memory-resident, so row pointers stay valid until the decoder is destroyed
+    // (jpeg_finish_decompress() would release them)
+    frame.rows.resize(frame.blocks_high);
+    for (int by = 0; by < frame.blocks_high; by++) {
+        JBLOCKARRAY row = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, arrays[0], by, 1, FALSE);
+        frame.rows[by] = row[0][0];
+    }
+    return true;
+}
+
+// Orthonormal 8-point IDCT basis: basis[x][u] = C(u)/2 * cos((2x+1)u*pi/16). peak2[v*8+u] is the
+// largest magnitude of the 2-D basis function (v, u) over the block.
+struct DctBasis {
+    float basis[DCTSIZE][DCTSIZE];
+    float peak2[DCTSIZE2];
+    DctBasis() {
+        float peak[DCTSIZE];
+        for (int u = 0; u < DCTSIZE; u++) {
+            peak[u] = 0.0f;
+            for (int x = 0; x < DCTSIZE; x++) {
+                double scale = u == 0 ? std::sqrt(0.125) : 0.5;
+                basis[x][u] = (float)(scale * std::cos((2 * x + 1) * u * M_PI / 16.0));
+                peak[u] = std::max(peak[u], std::fabs(basis[x][u]));
+            }
+        }
+        for (int k = 0; k < DCTSIZE2; k++) peak2[k] = peak[k / DCTSIZE] * peak[k % DCTSIZE];
+    }
+};
+
+static const DctBasis& dct_basis() {
+    static const DctBasis basis;
+    return basis;
+}
+
+// Reconstruct the pixels of one block (separable float IDCT, level shift, clamp)
+static void reconstruct_block(const JCOEF* coef, const uint16_t* quant, unsigned char* out) {
+    const DctBasis& dct = dct_basis();
+    float rows[DCTSIZE2] = { 0.0f };
+    for (int v = 0; v < DCTSIZE; v++) {
+        for (int u = 0; u < DCTSIZE; u++) {
+            int c = coef[v * DCTSIZE + u];
+            if (c == 0) continue;   // Most AC terms are zero
+            float f = (float)(c * quant[v * DCTSIZE + u]);
+            for (int x = 0; x < DCTSIZE; x++) rows[v * DCTSIZE + x] += f * dct.basis[x][u];
+        }
+    }
+    for (int y = 0; y < DCTSIZE; y++) {
+        float sum[DCTSIZE];
+        for (int x = 0; x < DCTSIZE; x++) sum[x] = 128.0f;
+        for (int v = 0; v < DCTSIZE; v++) {
+            float b = dct.basis[y][v];
+            for (int x = 0; x < DCTSIZE; x++) sum[x] += b * rows[v * DCTSIZE + x];
+        }
+        for (int x = 0; x < DCTSIZE; x++) {
+            out[y * DCTSIZE + x] = (unsigned char)std::max(0L, std::min(255L, std::lround(sum[x])));
+        }
+    }
+}
+
+// True if some pixel of the block may be clamped to 0 or 255
+static bool block_may_clip(const JCOEF* coef, const uint16_t* quant) {
+    const DctBasis& dct = dct_basis();
+    float ac = 0.0f;
+    for (int k = 1; k < DCTSIZE2; k++) {
+        ac += std::fabs((float)coef[k] * quant[k]) * dct.peak2[k];
+    }
+    float mean = 128.0f + coef[0] * quant[0] / 8.0f;
+    return mean - ac < 0.0f || mean + ac > 255.0f;
+}
+
+// Call fn(x0, x1) for each active run of mask row y within columns [x0, x1) (the whole range without a mask)
+template <typename Fn>
+static void for_each_mask_run(const MotionMask* mask, int y, int x0, int x1, Fn fn) {
+    if (!mask) {
+        fn(x0, x1);
+        return;
+    }
+    for (size_t i = mask->row_start[y]; i < mask->row_start[y + 1]; i++) {
+        int s0 = std::max(x0, mask->spans[i].x0), s1 = std::min(x1, mask->spans[i].x1);
+        if (s0 < s1) fn(s0, s1);
+    }
+}
+
+// Percentage of changed pixels inside the region [region_x, region_x + region_width) x [region_y, ...).
+// The mask, if given, is compiled for the region.
+float calculate_motion_coefficients(const CoefficientFrame& a, const CoefficientFrame& b,
+                                    int region_x, int region_y, int region_width, int region_height,
+                                    const MotionDetectionParams& params, const MotionMask* mask = nullptr,
+                                    CoefficientStats* stats = nullptr) {
+    if (mask && (mask->width != region_width || mask->height != region_height)) mask = nullptr;
+    size_t total_pixels = mask ? mask->active_pixels : (size_t)region_width * region_height;
+    if (total_pixels == 0) return 0.0f;
+    
+    int threshold = params.pixel_threshold;
+    if (threshold < 0) return 100.0f;     // Every difference (including 0) exceeds the threshold
+    if (threshold >= 255) return 0.0f;    // No 8-bit difference can exceed it
+    
+    const DctBasis& dct = dct_basis();
+    bool same_quant = memcmp(a.quant, b.quant, sizeof(a.quant)) == 0;
+    int bx0 = region_x / DCTSIZE, bx1 = (region_x + region_width + DCTSIZE - 1) / DCTSIZE;
+    int by0 = region_y / DCTSIZE, by1 = (region_y + region_height + DCTSIZE - 1) / DCTSIZE;
+    
+    StripePool& pool = stripe_pool(params.threads);
+    int stripes = std::max(1, std::min(pool.size(), by1 - by0));
+    std::vector<size_t> stripe_counts(stripes, 0);
+    std::vector<CoefficientStats> stripe_stats(stripes);
+    
+    pool.run(stripes, [&](int stripe) {
+        int row0 = by0 + (int)((int64_t)(by1 - by0) * stripe / stripes);
+        int row1 = by0 + (int)((int64_t)(by1 - by0) * (stripe + 1) / stripes);
+        CoefficientStats& st = stripe_stats[stripe];
+        size_t count = 0;
+        unsigned char pixels1[DCTSIZE2], pixels2[DCTSIZE2];
+        
+        for (int by = row0; by < row1; by++) {
+            // Block rows clipped to the region, in region coordinates
+            int y0 = std::max(by * DCTSIZE, region_y) - region_y;
+            int y1 = std::min(by * DCTSIZE + DCTSIZE, region_y + region_height) - region_y;
+            
+            for (int bx = bx0; bx < bx1; bx++) {
+                int x0 = std::max(bx * DCTSIZE, region_x) - region_x;
+                int x1 = std::min(bx * DCTSIZE + DCTSIZE, region_x + region_width) - region_x;
+                size_t active = (size_t)(x1 - x0) * (y1 - y0);
+                if (mask) {
+                    active = 0;
+                    for (int y = y0; y < y1; y++) {
+                        for_each_mask_run(mask, y, x0, x1, [&](int s0, int s1) { active += s1 - s0; });
+                    }
+                    if (active == 0) continue;
+                }
+                
+                const JCOEF* ca = a.rows[by] + (size_t)bx * DCTSIZE2;
+                const JCOEF* cb = b.rows[by] + (size_t)bx * DCTSIZE2;
+                if (same_quant && memcmp(ca, cb, sizeof(JBLOCK)) == 0) {
+                    st.identical++;
+                    continue;
+                }
+                
+                // Bounds on the largest pixel difference of the block
+                float dc = std::fabs((float)ca[0] * a.quant[0] - (float)cb[0] * b.quant[0]) / 8.0f;
+                float ac = 0.0f, energy = dc * dc * 64.0f;
+                for (int k = 1; k < DCTSIZE2; k++) {
+                    float d = (float)(ca[k] * a.quant[k] - cb[k] * b.quant[k]);
+                    ac += std::fabs(d) * dct.peak2[k];
+                    energy += d * d;
+                }
+                if (std::min(dc + ac, std::sqrt(energy)) <= threshold) {
+                    st.bounded++;
+                    continue;
+                }
+                
+                // The DC shift outweighs every AC term: all pixels differ by more than threshold + 1,
+                // so they still do after rounding unless clamping flattens them
+                if (dc - ac > threshold + 1 && !block_may_clip(ca, a.quant) && !block_may_clip(cb, b.quant)) {
+                    st.full++;
+                    count += active;
+                    continue;
+                }
+                
+                st.decoded++;
+                reconstruct_block(ca, a.quant, pixels1);
+                reconstruct_block(cb, b.quant, pixels2);
+                for (int y = y0; y < y1; y++) {
+                    int row = (y + region_y - by * DCTSIZE) * DCTSIZE - bx * DCTSIZE + region_x;
+                    for_each_mask_run(mask, y, x0, x1, [&](int s0, int s1) {
+                        for (int x = s0; x < s1; x++) {
+                            count += abs((int)pixels1[row + x] - (int)pixels2[row + x]) > threshold;
+                        }
+                    });
+                }
+            }
+        }
+        stripe_counts[stripe] = count;
+    });
+    
+    size_t motion_pixels = 0;
+    for (int i = 0; i < stripes; i++) {
+        motion_pixels += stripe_counts[i];
+        if (stats) {
+            stats->identical += stripe_stats[i].identical;
+            stats->bounded += stripe_stats[i].bounded;
+            stats->full += stripe_stats[i].full;
+            stats->decoded += stripe_stats[i].decoded;
+        }
+    }
+    return (float)motion_pixels / total_pixels * 100.0f;
+}
+
+// Motion percentage for output; a decision-only scan that stopped early only knows a bound
+// and a sampled comparison reports its confidence interval
+std::string format_motion_percentage(float motion_percentage, const MotionDetectionParams& params,
+                                     bool stopped_early, const SampleEstimate* estimate = nullptr) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2);
+    if (stopped_early) out << (motion_percentage >= params.motion_threshold ? ">= " : "<= ");
+    out << motion_percentage << "%";
+    if (estimate) {
+        out << " (95% CI " << estimate->low << "-" << estimate->high << "%, " << estimate->samples << " samples)";
+    }
+    return out.str();
 }
 
-// Load JPEG using libjpeg-turbo with scale factor applied during decode
-unsigned char* load_jpeg_safe(const char* filename, int* width, int* height, int* channels, 
-                              int scale_factor, bool verbose, bool ultra_fast = false) {
-    if (verbose) {
-        std::cout << "Loading JPEG with libjpeg-turbo: " << filename;
-        if (scale_factor > 1) {
-            std::cout << " (decode scale: 1/" << scale_factor << ")";
+// Print the motion grid as one JSON line (tile percentages, row-major) and, with --grid-bin,
+// append it to the binary map file: "MDG1", cols and rows as little-endian uint16, then one byte
+// per tile (changed fraction scaled to 0-255)
+void print_motion_grid(const MotionGrid& grid, float motion_percentage, const MotionDetectionParams& params,
+                       const std::string& frame = std::string()) {
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(2) << "{";
+    if (!frame.empty()) {
+        json << "\"frame\":\"";
+        for (char c : frame) {
+            if (c == '"' || c == '\\') json << '\\';
+            json << c;
         }
-        std::cout << std::endl;
+        json << "\",";
     }
+    json << "\"motion\":" << motion_percentage << ",\"cols\":" << grid.cols << ",\"rows\":" << grid.rows << ",\"tiles\":[";
+    for (size_t i = 0; i < grid.changed.size(); i++) json << (i ? "," : "") << grid.percentage(i);
+    json << "]}";
+    std::cout << json.str() << std::endl;
     
-    FILE* infile = fopen(filename, "rb");
-    if (!infile) {
-        if (verbose) std::cerr << "Cannot open file: " << filename << std::endl;
-        return nullptr;
+    if (params.grid_bin.empty()) return;
+    static FILE* map_file = nullptr;   // Opened once, so a stream writes one record per frame
+    if (!map_file) map_file = fopen(params.grid_bin.c_str(), "wb");
+    if (!map_file) {
+        std::cerr << "Cannot write grid map: " << params.grid_bin << std::endl;
+        return;
     }
-    
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr_custom jerr;
-    
-    cinfo.err = jpeg_std_error(&jerr.pub);
-    jerr.pub.error_exit = jpeg_error_exit_custom;
-    
-    if (setjmp(jerr.setjmp_buffer)) {
-        jpeg_destroy_decompress(&cinfo);
-        fclose(infile);
-        if (verbose) std::cerr << "JPEG error during decompression" << std::endl;
-        return nullptr;
+    std::vector<unsigned char> record = { 'M', 'D', 'G', '1',
+                                          (unsigned char)(grid.cols & 0xFF), (unsigned char)(grid.cols >> 8),
+                                          (unsigned char)(grid.rows & 0xFF), (unsigned char)(grid.rows >> 8) };
+    for (size_t i = 0; i < grid.changed.size(); i++) {
+        size_t active = grid.active[i];
+        record.push_back(active > 0 ? (unsigned char)((grid.changed[i] * 255 + active / 2) / active) : 0);
     }
+    fwrite(record.data(), 1, record.size(), map_file);
+    fflush(map_file);
+}
+
+// Print the motion result of a two-image comparison
+void print_motion_result(float motion_percentage, const MotionDetectionParams& params, bool stopped_early = false,
+                         const SampleEstimate* estimate = nullptr) {
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Motion detected: " << format_motion_percentage(motion_percentage, params, stopped_early, estimate)
+              << (stopped_early ? " (stopped early)" : "") << std::endl;
     
-    jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, infile);
-    jpeg_read_header(&cinfo, TRUE);
+    if (motion_percentage >= params.motion_threshold) {
+        std::cout << "MOTION DETECTED (threshold: " << params.motion_threshold << "%)" << std::endl;
+    } else {
+        std::cout << "No significant motion (threshold: " << params.motion_threshold << "%)" << std::endl;
+    }
+}
+
+// Two-image comparison in the coefficient domain (--coeff)
+int run_coefficient_compare(const char* image1_path, const char* image2_path, const MotionDetectionParams& params) {
+    auto start_time = std::chrono::high_resolution_clock::now();
     
-    // Apply scale factor during decode - much more efficient!
-    if (scale_factor > 1) {
-        // libjpeg-turbo supports 1/2, 1/4, 1/8 scaling during decode
-        if (scale_factor >= 8) {
-            cinfo.scale_num = 1;
-            cinfo.scale_denom = 8;  // 1/8 scale
-            if (verbose) std::cout << "Decode scaling: 1/8 (requested -s " << scale_factor << ")" << std::endl;
-        } else if (scale_factor >= 4) {
-            cinfo.scale_num = 1;
-            cinfo.scale_denom = 4;  // 1/4 scale
-            if (verbose) std::cout << "Decode scaling: 1/4 (requested -s " << scale_factor << ")" << std::endl;
-        } else if (scale_factor >= 2) {
-            cinfo.scale_num = 1;
-            cinfo.scale_denom = 2;  // 1/2 scale
-            if (verbose) std::cout << "Decode scaling: 1/2 (requested -s " << scale_factor << ")" << std::endl;
-        }
+    CoefficientFrame frame1, frame2;
+    bool ok2 = false;
+    std::thread read_thread;
+    bool parallel_read = std::thread::hardware_concurrency() > 1;
+    if (parallel_read) read_thread = std::thread([&] { ok2 = read_luma_coefficients(image2_path, frame2, params.verbose); });
+    bool ok1 = read_luma_coefficients(image1_path, frame1, params.verbose);
+    if (parallel_read) {
+        read_thread.join();
+    } else if (ok1) {
+        ok2 = read_luma_coefficients(image2_path, frame2, params.verbose);
     }
+    auto read_end = std::chrono::high_resolution_clock::now();
     
-    // Additional Pi Zero safety: force scaling for large images
-    if ((cinfo.image_width > 1280 || cinfo.image_height > 720) && scale_factor == 1) {
-        cinfo.scale_num = 1;
-        cinfo.scale_denom = 2;  // Force 1/2 scale for large images on Pi Zero
-        if (verbose) {
-            std::cout << "Pi Zero safety: Auto-scaling " << cinfo.image_width << "x" << cinfo.image_height 
-                      << " to 1/2 during decode" << std::endl;
-        }
+    if (!ok1 || !ok2) {
+        std::cerr << "Failed to load image: " << (ok1 ? image2_path : image1_path) << std::endl;
+        return 1;
+    }
+    if (frame1.width != frame2.width || frame1.height != frame2.height ||
+        frame1.blocks_wide != frame2.blocks_wide || frame1.blocks_high != frame2.blocks_high) {
+        std::cerr << "Image dimensions don't match!" << std::endl;
+        std::cerr << "Image 1: " << frame1.width << "x" << frame1.height << std::endl;
+        std::cerr << "Image 2: " << frame2.width << "x" << frame2.height << std::endl;
+        return 1;
     }
     
-    // Ultra-fast mode optimizations (like DC-only mode)
-    if (ultra_fast) {
-        cinfo.dct_method = JDCT_FASTEST;           // Fast IDCT (4-14% speedup)
-        cinfo.do_fancy_upsampling = FALSE;        // Fast upsampling (15-20% speedup)
-        cinfo.do_block_smoothing = FALSE;         // Disable smoothing for speed
-        cinfo.two_pass_quantize = FALSE;          // Single-pass quantization
-        if (verbose) {
-            std::cout << " [ULTRA-FAST: fastest IDCT + upsampling]";
+    // Region compared: the ROI clamped to the image, or the whole image
+    int x0 = 0, y0 = 0, x1 = frame1.width, y1 = frame1.height;
+    if (params.use_roi) {
+        x0 = std::max(0, params.roi.x);
+        y0 = std::max(0, params.roi.y);
+        x1 = (int)std::min<int64_t>(x1, (int64_t)params.roi.x + params.roi.width);
+        y1 = (int)std::min<int64_t>(y1, (int64_t)params.roi.y + params.roi.height);
+        if (x0 >= x1 || y0 >= y1) {
+            std::cerr << "ROI is outside the image (" << frame1.width << "x" << frame1.height << ")" << std::endl;
+            return 1;
         }
     }
     
-    jpeg_start_decompress(&cinfo);
+    MotionMask mask;
+    if (!params.mask.empty()) compile_motion_mask(params.mask, x1 - x0, y1 - y0, 1, mask, x0, y0);
     
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
-    *channels = cinfo.output_components;
+    CoefficientStats stats;
+    float motion_percentage = calculate_motion_coefficients(frame1, frame2, x0, y0, x1 - x0, y1 - y0, params,
+                                                            params.mask.empty() ? nullptr : &mask, &stats);
+    auto end_time = std::chrono::high_resolution_clock::now();
     
-    if (verbose) {
-        std::cout << "JPEG loaded: " << *width << "x" << *height << " channels=" << *channels 
-                  << " (memory: " << (*width * *height * *channels / 1024) << " KB)" << std::endl;
-    }
+    print_motion_result(motion_percentage, params);
     
-    // Allocate memory for image
-    size_t image_size = (size_t)(*width) * (*height) * (*channels);
-    unsigned char* image_data = (unsigned char*)malloc(image_size);
-    if (!image_data) {
-        jpeg_finish_decompress(&cinfo);
-        jpeg_destroy_decompress(&cinfo);
-        fclose(infile);
-        if (verbose) std::cerr << "Cannot allocate memory for image (" << (image_size/1024) << " KB)" << std::endl;
-        return nullptr;
+    if (params.verbose) {
+        auto read_duration = std::chrono::duration_cast<std::chrono::microseconds>(read_end - start_time);
+        auto compare_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - read_end);
+        size_t blocks = stats.identical + stats.bounded + stats.full + stats.decoded;
+        std::cout << "Timing breakdown:" << std::endl;
+        std::cout << "  Coefficient read: " << (read_duration.count() / 1000.0) << " ms"
+                  << (parallel_read ? " (parallel)" : "") << std::endl;
+        std::cout << "  Block compare:    " << (compare_duration.count() / 1000.0) << " ms" << std::endl;
+        std::cout << "Coefficient blocks: " << blocks << " compared, " << stats.identical << " identical, "
+                  << stats.bounded << " within bound, " << stats.full << " fully changed, "
+                  << stats.decoded << " decoded (" << std::setprecision(1)
+                  << (blocks ? 100.0 * stats.decoded / blocks : 0.0) << "%)" << std::endl;
     }
     
-    // Read scanlines
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, 
-                                                   cinfo.output_width * cinfo.output_components, 1);
+    return motion_percentage >= params.motion_threshold ? 0 : 1;
+}
+
+// Two-image comparison with both JPEGs decoded in lockstep (--lockstep): each batch of scanlines
+// is decoded from both files and diffed immediately, so only a few rows per image are resident,
+// and with --decide decoding stops as soon as the outcome is known.
+int run_lockstep_compare(const char* image1_path, const char* image2_path, const MotionDetectionParams& params) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    
+    std::unique_ptr<ScanlineReader> reader1(new ScanlineReader), reader2(new ScanlineReader);
+    // Reports a libjpeg error from either reader
+    auto decode_error = [&]() {
+        std::cerr << "JPEG error while decoding: " << (reader1->failed() ? image1_path : image2_path) << std::endl;
+        return 1;
+    };
     
-    unsigned char* row_ptr = image_data;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines(&cinfo, buffer, 1);
-        memcpy(row_ptr, buffer[0], cinfo.output_width * cinfo.output_components);
-        row_ptr += cinfo.output_width * cinfo.output_components;
+    if (!is_jpeg_filename(image1_path) || !reader1->open(image1_path, params)) {
+        if (reader1->failed()) return decode_error();
+        std::cerr << "Failed to load image: " << image1_path << std::endl;
+        return 1;
+    }
+    if (!is_jpeg_filename(image2_path) || !reader2->open(image2_path, params)) {
+        if (reader2->failed()) return decode_error();
+        std::cerr << "Failed to load image: " << image2_path << std::endl;
+        return 1;
     }
     
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
-    fclose(infile);
-    
-    return image_data;
-}
-
-// Load image using appropriate loader with scaling
-unsigned char* load_image_safe(const char* filename, int* width, int* height, int* channels, 
-                               int scale_factor, bool verbose, bool ultra_fast = false) {
-    if (!filename || !width || !height || !channels) {
-        return nullptr;
+    int width = reader1->width(), height = reader1->height(), channels = reader1->channels();
+    if (width != reader2->width() || height != reader2->height() || channels != reader2->channels()) {
+        std::cerr << "Image dimensions don't match after scaling!" << std::endl;
+        std::cerr << "Image 1: " << width << "x" << height << " (channels: " << channels << ")" << std::endl;
+        std::cerr << "Image 2: " << reader2->width() << "x" << reader2->height()
+                  << " (channels: " << reader2->channels() << ")" << std::endl;
+        return 1;
     }
     
-    // Check file extension
-    const char* ext = strrchr(filename, '.');
-    if (!ext) {
-        if (verbose) std::cerr << "No file extension found" << std::endl;
-        return nullptr;
+    int scale_denom = reader1->scale_denom();
+    MotionMask mask;
+    if (!params.mask.empty()) {
+        compile_motion_mask(params.mask, width, height, scale_denom, mask,
+                            params.use_roi ? std::max(0, params.roi.x) / scale_denom : 0,
+                            params.use_roi ? std::max(0, params.roi.y) / scale_denom : 0);
     }
+    const MotionMask* row_mask = params.mask.empty() ? nullptr : &mask;
+    size_t total_pixels = row_mask ? mask.active_pixels : (size_t)width * height;
     
-    // Convert to lowercase for comparison
-    std::string ext_lower = ext;
-    std::transform(ext_lower.begin(), ext_lower.end(), ext_lower.begin(), ::tolower);
+    std::unique_ptr<EarlyExit> early;
+    if (params.decision_only) early.reset(new EarlyExit(total_pixels, params.motion_threshold));
     
-    if (ext_lower == ".jpg" || ext_lower == ".jpeg") {
-        return load_jpeg_safe(filename, width, height, channels, scale_factor, verbose, ultra_fast);
-    } else {
-        if (verbose) std::cerr << "Unsupported file format: " << ext << " (only JPEG supported)" << std::endl;
-        return nullptr;
+    // Blur pulls its input rows straight from the decoders
+    std::unique_ptr<RowBlur> blur1, blur2;
+    if (params.enable_blur) {
+        ScanlineReader* source1 = reader1.get();
+        ScanlineReader* source2 = reader2.get();
+        blur1.reset(new RowBlur([source1](int y) { return source1->row(y); }, width, height, channels,
+                                params.use_rgb, params.blur_radius, params.blur_passes));
+        blur2.reset(new RowBlur([source2](int y) { return source2->row(y); }, width, height, channels,
+                                params.use_rgb, params.blur_radius, params.blur_passes));
     }
-}
-
-// Ultra-fast blur: convert to grayscale first, then blur only one channel
-void apply_blur_fast(unsigned char* img, int width, int height, int channels, bool use_rgb) {
-    if (!img || width < 3 || height < 3) return;
+    int row_channels = blur1 ? blur1->channels() : channels;
+    bool average_gray = !blur1 && !params.use_rgb && channels >= 3;
+    const DiffKernels& kernels = select_diff_kernels(params.use_simd);
     
-    if (!use_rgb && channels >= 3) {
-        // Convert to grayscale first, then blur only channel 0
-        for (int i = 0; i < width * height; i++) {
-            int gray = (img[i*3] + img[i*3+1] + img[i*3+2]) / 3;
-            img[i*3] = img[i*3+1] = img[i*3+2] = gray;
+    // Sampled comparison: only the sampled rows are decoded, the decoder skips the rest
+    if (params.sample_budget > 0) {
+        SamplePlan plan(width, height, params.sample_budget, params.sample_random);
+        if (!blur1) {
+            reader1->set_single_rows(true);
+            reader2->set_single_rows(true);
+        }
+        SampleEstimate estimate;
+        for (size_t band = 0; band < plan.bands(); band++) {
+            int row = plan.row(band);
+            const unsigned char* row1 = blur1 ? blur1->row(row) : reader1->row(row);
+            const unsigned char* row2 = blur2 ? blur2->row(row) : reader2->row(row);
+            if (!row1 || !row2) return decode_error();
+            estimate.changed += count_sampled_row(row1, row2, row, plan.columns(band), plan.columns_per_row(),
+                                                  row_channels, average_gray, params.pixel_threshold, row_mask,
+                                                  &estimate.samples);
+        }
+        float motion_percentage = finish_sample_estimate(estimate);
+        auto end_time = std::chrono::high_resolution_clock::now();
+        
+        print_motion_result(motion_percentage, params, false, &estimate);
+        
+        if (params.verbose) {
+            auto total_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
+            std::cout << "Sampled decode: " << width << "x" << height << " (" << channels << " channels), "
+                      << "one sample per " << plan.step() << "x" << plan.step() << " cell, "
+                      << reader1->rows_decoded() << "/" << height << " and " << reader2->rows_decoded() << "/"
+                      << height << " rows decoded" << std::endl;
+            std::cout << "  Total time:    " << (total_duration.count() / 1000.0) << " ms" << std::endl;
         }
+        reader1->close();
+        reader2->close();
+        return motion_percentage >= params.motion_threshold ? 0 : 1;
     }
     
-    // Now blur only the first channel (or all if RGB mode)
-    int blur_channels = use_rgb ? channels : 1;
-    std::vector<unsigned char> temp_row(width * blur_channels);
+    std::unique_ptr<MotionGrid> grid;
+    if (params.grid_cols > 0) {
+        grid.reset(new MotionGrid);
+        init_motion_grid(*grid, params.grid_cols, params.grid_rows, width, height, row_mask);
+    }
     
-    // Fast separable blur: horizontal then vertical (much faster!)
-    // Horizontal pass
-    for (int y = 1; y < height - 1; y++) {
-        for (int c = 0; c < blur_channels; c++) {
-            for (int x = 1; x < width - 1; x++) {
-                int sum = img[(y * width + x - 1) * channels + c] +
-                         img[(y * width + x) * channels + c] +
-                         img[(y * width + x + 1) * channels + c];
-                temp_row[x * blur_channels + c] = sum / 3;
-            }
-        }
-        // Copy back
-        for (int x = 1; x < width - 1; x++) {
-            for (int c = 0; c < blur_channels; c++) {
-                img[(y * width + x) * channels + c] = temp_row[x * blur_channels + c];
+    size_t motion_pixels = 0;
+    for (int y = 0; y < height && !(early && early->decided()); y += DECISION_CHUNK_ROWS) {
+        int y_end = std::min(height, y + DECISION_CHUNK_ROWS);
+        size_t changed = 0, scanned = 0;
+        for (int row = y; row < y_end; row++) {
+            // Both decoders advance batch by batch; each row is diffed as soon as it is decoded
+            const unsigned char* row1 = blur1 ? blur1->row(row) : reader1->row(row);
+            const unsigned char* row2 = blur2 ? blur2->row(row) : reader2->row(row);
+            if (!row1 || !row2) return decode_error();
+            size_t* tile_counts = grid ? &grid->changed[(size_t)grid->row_of(row) * grid->cols] : nullptr;
+            changed += count_changed_row(row1, row2, row, width, row_channels, average_gray,
+                                         params.pixel_threshold, kernels, row_mask, grid.get(), tile_counts);
+            if (!row_mask) {
+                scanned += width;
+            } else {
+                for (size_t i = mask.row_start[row]; i < mask.row_start[row + 1]; i++) {
+                    scanned += mask.spans[i].x1 - mask.spans[i].x0;
+                }
             }
         }
+        motion_pixels += changed;
+        if (early) early->add(changed, scanned);
     }
     
-    // Vertical pass  
-    for (int x = 1; x < width - 1; x++) {
-        for (int c = 0; c < blur_channels; c++) {
-            for (int y = 1; y < height - 1; y++) {
-                int sum = img[((y - 1) * width + x) * channels + c] +
-                         img[(y * width + x) * channels + c] +
-                         img[((y + 1) * width + x) * channels + c];
-                temp_row[y * blur_channels + c] = sum / 3;
-            }
-        }
-        // Copy back
-        for (int y = 1; y < height - 1; y++) {
-            for (int c = 0; c < blur_channels; c++) {
-                img[(y * width + x) * channels + c] = temp_row[y * blur_channels + c];
-            }
-        }
+    bool stopped_early = early && early->decided();
+    float motion_percentage = stopped_early ? early->result()
+                            : total_pixels > 0 ? (float)motion_pixels / total_pixels * 100.0f : 0.0f;
+    auto end_time = std::chrono::high_resolution_clock::now();
+    
+    print_motion_result(motion_percentage, params, stopped_early);
+    if (grid) print_motion_grid(*grid, motion_percentage, params);
+    
+    if (params.verbose) {
+        auto total_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
+        std::cout << "Lockstep decode: " << width << "x" << height << " (" << channels << " channels), "
+                  << reader1->rows_decoded() << "/" << height << " and " << reader2->rows_decoded() << "/" << height
+                  << " rows decoded" << std::endl;
+        std::cout << "Row buffers: " << ((reader1->buffer_bytes() + reader2->buffer_bytes()) / 1024)
+                  << " KB (whole frames: " << ((size_t)width * height * channels * 2 / 1024) << " KB)" << std::endl;
+        std::cout << "  Total time:    " << (total_duration.count() / 1000.0) << " ms" << std::endl;
     }
+    
+    // Rows the decision did not need are never decoded
+    reader1->close();
+    reader2->close();
+    return motion_percentage >= params.motion_threshold ? 0 : 1;
 }
 
-// Calculate motion on already-scaled images (no pixel skipping needed!)
-float calculate_motion_scaled(const unsigned char* img1, const unsigned char* img2,
-                              int width, int height, int channels,
-                              const MotionDetectionParams& params) {
-    if (!img1 || !img2 || width <= 0 || height <= 0 || channels <= 0) {
-        return 0.0f;
-    }
+// Print one result line per streamed frame (flushed so pipe readers see it immediately)
+void print_stream_result(const std::string& name, float motion_percentage, const MotionDetectionParams& params,
+                         bool stopped_early = false, const SampleEstimate* estimate = nullptr) {
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << name << ": " << format_motion_percentage(motion_percentage, params, stopped_early, estimate) << " "
+              << (motion_percentage >= params.motion_threshold ? "MOTION DETECTED" : "no motion") << std::endl;
+}
+
+// One frame of a stream: a file path, or JPEG bytes already in memory
+struct StreamFrame {
+    std::string name;                  // Path (or label for in-memory frames)
+    std::vector<unsigned char> data;   // JPEG bytes; empty = decode the file at name
+};
+
+// Streaming mode: compare every frame against the previous one.
+// The previous frame stays decoded in memory, so each frame is decoded exactly once.
+int run_stream(const std::function<bool(StreamFrame&)>& next_frame, const MotionDetectionParams& params) {
+    unsigned char* prev = nullptr;
+    int prev_width = 0, prev_height = 0, prev_channels = 0;
+    bool any_motion = false;
+    size_t frames = 0;
+    MotionMask mask;
+    std::unique_ptr<BackgroundModel> background;
+    if (params.background_shift > 0) background.reset(new BackgroundModel(params));
     
-    // Apply blur if enabled (creates copies for processing)
-    unsigned char* processed_img1 = nullptr;
-    unsigned char* processed_img2 = nullptr;
+    // One decoder for the whole stream: no libjpeg setup or heap allocation per frame
+    JpegDecoder decoder(true);
     
-    if (params.enable_blur) {
-        size_t img_size = width * height * channels;
-        processed_img1 = (unsigned char*)malloc(img_size);
-        processed_img2 = (unsigned char*)malloc(img_size);
+    StreamFrame frame;
+    while (next_frame(frame)) {
+        const std::string& path = frame.name;
+        int width, height, channels, scale_denom;
         
-        if (processed_img1 && processed_img2) {
-            memcpy(processed_img1, img1, img_size);
-            memcpy(processed_img2, img2, img_size);
-            apply_blur_fast(processed_img1, width, height, channels, params.use_rgb);
-            apply_blur_fast(processed_img2, width, height, channels, params.use_rgb);
-            img1 = processed_img1;
-            img2 = processed_img2;
+        auto load_start = std::chrono::high_resolution_clock::now();
+        unsigned char* img = frame.data.empty()
+            ? load_image_safe(path.c_str(), &width, &height, &channels, params, &scale_denom, &decoder)
+            : load_jpeg_mem(frame.data.data(), frame.data.size(), path.c_str(), &width, &height, &channels,
+                            params, &scale_denom, &decoder);
+        auto load_end = std::chrono::high_resolution_clock::now();
+        if (!img) {
+            std::cerr << "Failed to load image: " << path << std::endl;
+            continue;
         }
-    }
-    
-    int total_pixels = width * height;
-    int motion_pixels = 0;
-    
-    // Process all pixels (no skipping needed since we scaled during decode!)
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int idx = (y * width + x) * channels;
+        frames++;
+        
+        bool has_reference = background ? background->matches(width, height, channels)
+                                        : prev && width == prev_width && height == prev_height && channels == prev_channels;
+        if (!has_reference) {
+            if (frames > 1) {
+                std::cerr << "Frame size changed (" << width << "x" << height << ", channels: " << channels
+                          << "), using " << path << " as new reference" << std::endl;
+            } else if (params.verbose) {
+                std::cout << "Reference frame: " << path << std::endl;
+            }
+            if (background) background->reset(img, width, height, channels);
+        } else {
+            // The mask is compiled once and reused until the frame size changes
+            if (!params.mask.empty() &&
+                (mask.width != width || mask.height != height || mask.scale_denom != scale_denom)) {
+                compile_motion_mask(params.mask, width, height, scale_denom, mask,
+                                    params.use_roi ? std::max(0, params.roi.x) / scale_denom : 0,
+                                    params.use_roi ? std::max(0, params.roi.y) / scale_denom : 0);
+            }
             
-            if (!params.use_rgb && channels >= 3) {
-                // Convert to grayscale and compare
-                int gray1 = (img1[idx] + img1[idx+1] + img1[idx+2]) / 3;
-                int gray2 = (img2[idx] + img2[idx+1] + img2[idx+2]) / 3;
-                
-                if (abs(gray1 - gray2) > params.pixel_threshold) {
-                    motion_pixels++;
-                }
-            } else {
-                // Compare all channels
-                bool pixel_changed = false;
-                for (int c = 0; c < channels; c++) {
-                    if (abs((int)img1[idx + c] - (int)img2[idx + c]) > params.pixel_threshold) {
-                        pixel_changed = true;
-                        break;
-                    }
-                }
-                if (pixel_changed) {
-                    motion_pixels++;
-                }
+            auto motion_start = std::chrono::high_resolution_clock::now();
+            bool stopped_early = false;
+            SampleEstimate estimate;
+            MotionGrid grid;
+            float motion_percentage = background
+                ? background->compare_and_update(img, params.mask.empty() ? nullptr : &mask, &grid)
+                : calculate_motion_scaled(prev, img, width, height, channels, params,
+                                          params.mask.empty() ? nullptr : &mask, &stopped_early, &estimate, &grid);
+            auto motion_end = std::chrono::high_resolution_clock::now();
+            
+            if (motion_percentage >= params.motion_threshold) any_motion = true;
+            print_stream_result(path, motion_percentage, params, stopped_early,
+                                params.sample_budget > 0 ? &estimate : nullptr);
+            if (params.grid_cols > 0) print_motion_grid(grid, motion_percentage, params, path);
+            
+            if (params.verbose) {
+                auto load_duration = std::chrono::duration_cast<std::chrono::microseconds>(load_end - load_start);
+                auto motion_duration = std::chrono::duration_cast<std::chrono::microseconds>(motion_end - motion_start);
+                std::cout << "  Image loading: " << (load_duration.count() / 1000.0) << " ms, motion calc: "
+                          << (motion_duration.count() / 1000.0) << " ms" << std::endl;
             }
         }
+        
+        // Keep the current frame resident as the next reference (the background model replaces it)
+        g_frame_pool.release(prev);
+        if (background) {
+            g_frame_pool.release(img);
+            img = nullptr;
+        }
+        prev = img;
+        prev_width = width;
+        prev_height = height;
+        prev_channels = channels;
     }
     
-    // Clean up blur buffers if used
-    if (processed_img1) free(processed_img1);
-    if (processed_img2) free(processed_img2);
+    if (params.verbose) {
+        std::cout << "Stream finished: " << frames << " frames decoded (" << g_decode_stats.bytes_copied
+                  << " bytes copied after decode)" << std::endl;
+        const JpegArena* arena = decoder.arena();
+        std::cout << "Decoder reused for " << decoder.frames() << " frames: " << arena->heap_allocations()
+                  << " libjpeg heap allocations (" << (arena->reserved_bytes() / 1024) << " KB arena), "
+                  << decoder.allocation_free_frames() << " frames decoded without any" << std::endl;
+        std::cout << "Frame pool: " << g_frame_pool.allocations() << " buffer allocations, "
+                  << g_frame_pool.reuses() << " buffers reused" << std::endl;
+    }
     
-    return total_pixels > 0 ? (float)motion_pixels / total_pixels * 100.0f : 0.0f;
+    g_frame_pool.release(prev);
+    return any_motion ? 0 : 1;
 }
 
-// File size comparison
-float compare_file_sizes(const char* file1, const char* file2, const MotionDetectionParams& params) {
-    struct stat stat1, stat2;
+// Stream source: a directory (JPEGs processed in name order) or a file/FIFO/"-" listing one path per line.
+// A FIFO is reopened on EOF so writers can come and go while the detector keeps running.
+int run_stream_source(const char* source, const MotionDetectionParams& params) {
+    struct stat st;
+    bool is_stdin = strcmp(source, "-") == 0;
+    if (!is_stdin && stat(source, &st) != 0) {
+        std::cerr << "Cannot open stream source: " << source << std::endl;
+        return 1;
+    }
     
-    if (stat(file1, &stat1) != 0 || stat(file2, &stat2) != 0) {
-        return -1.0f; // Error
+    if (!is_stdin && S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(source);
+        if (!dir) {
+            std::cerr << "Cannot open directory: " << source << std::endl;
+            return 1;
+        }
+        std::vector<std::string> files;
+        while (struct dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] != '.' && is_jpeg_filename(entry->d_name)) {
+                files.push_back(std::string(source) + "/" + entry->d_name);
+            }
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+        
+        if (params.verbose) {
+            std::cout << "Streaming " << files.size() << " frames from directory " << source << std::endl;
+        }
+        size_t next = 0;
+        return run_stream([&](StreamFrame& frame) {
+            if (next >= files.size()) return false;
+            frame.name = files[next++];
+            return true;
+        }, params);
     }
     
-    if (stat1.st_size == 0 || stat2.st_size == 0) {
-        return -1.0f; // Invalid file
+    bool is_fifo = !is_stdin && S_ISFIFO(st.st_mode);
+    std::ifstream file;
+    if (!is_stdin) {
+        file.open(source);
+        if (!file) {
+            std::cerr << "Cannot open stream source: " << source << std::endl;
+            return 1;
+        }
     }
+    std::istream& in = is_stdin ? std::cin : file;
     
-    float size_diff = abs((long)(stat1.st_size - stat2.st_size));
-    float avg_size = (stat1.st_size + stat2.st_size) / 2.0f;
-    float percentage = (size_diff / avg_size) * 100.0f;
+    return run_stream([&](StreamFrame& frame) {
+        std::string& path = frame.name;
+        for (;;) {
+            if (std::getline(in, path)) {
+                if (!path.empty() && path[path.size() - 1] == '\r') path.erase(path.size() - 1);
+                if (!path.empty()) return true;
+                continue;
+            }
+            if (!is_fifo) return false;
+            // All writers closed the FIFO - wait for the next one
+            file.close();
+            file.clear();
+            file.open(source);
+            if (!file) return false;
+        }
+    }, params);
+}
+
+// Read length-prefixed JPEG frames from stdin: 4-byte big-endian size followed by the JPEG bytes.
+// Frames are decoded straight from memory - nothing touches the filesystem.
+int run_stdin_frames(const MotionDetectionParams& params) {
+    const uint32_t max_frame_size = 64u << 20;
+    size_t index = 0;
     
-    if (params.verbose) {
-        std::cout << "File sizes: " << stat1.st_size << " vs " << stat2.st_size 
-                  << " (diff: " << std::fixed << std::setprecision(1) << percentage << "%)" << std::endl;
+    return run_stream([&](StreamFrame& frame) {
+        unsigned char header[4];
+        if (fread(header, 1, 4, stdin) != 4) return false;
+        uint32_t size = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                        ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+        if (size == 0 || size > max_frame_size) {
+            std::cerr << "Invalid frame size on stdin: " << size << " bytes" << std::endl;
+            return false;
+        }
+        
+        // The buffer is reused, so steady-state frames don't reallocate
+        frame.data.resize(size);
+        if (fread(frame.data.data(), 1, size, stdin) != size) {
+            std::cerr << "Truncated frame on stdin" << std::endl;
+            return false;
+        }
+        frame.name = "frame " + std::to_string(++index);
+        return true;
+    }, params);
+}
+
+// Watch mode: process JPEGs as they are completed in a spool directory, each against the previous one.
+// Only IN_CLOSE_WRITE (writer closed the file) and IN_MOVED_TO (renamed into place) are used, so a
+// frame is never decoded while it is still being written; dot files (temporary names) are ignored.
+int run_watch(const char* directory, const MotionDetectionParams& params) {
+#if defined(__linux__)
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Cannot initialise inotify: " << strerror(errno) << std::endl;
+        return 1;
     }
-    
-    return percentage;
+    if (inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        std::cerr << "Cannot watch directory: " << directory << " (" << strerror(errno) << ")" << std::endl;
+        close(fd);
+        return 1;
+    }
+    std::vector<std::string> pending;
+    size_t next = 0;
+    bool watching = true;
+    alignas(struct inotify_event) char events[4096];
+    int result = run_stream([&](StreamFrame& frame) {
+        while (next == pending.size()) {
+            if (!watching) return false;
+            pending.clear();
+            next = 0;
+            ssize_t n = read(fd, events, sizeof(events));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            for (char* p = events; p < events + n;) {
+                const struct inotify_event* event = (const struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    std::cerr << "Watch queue overflowed, some frames were missed" << std::endl;
+                }
+                // The directory was deleted or unmounted: finish the frames already queued
+                if (event->mask & IN_IGNORED) watching = false;
+                if (event->len == 0 || (event->mask & IN_ISDIR) || event->name[0] == '.' ||
+                    !is_jpeg_filename(event->name)) {
+                    continue;
+                }
+                pending.push_back(std::string(directory) + "/" + event->name);
+            }
+        }
+        frame.name = pending[next++];
+        return true;
+    }, params);
+    close(fd);
+    return result;
+#else
+    std::cerr << "--watch needs Linux (inotify); use --stream with a FIFO instead" << std::endl;
+    return 1;
+#endif
 }
 
 void print_usage(const char* program_name) {
     std::cout << "Motion Detector (libjpeg-turbo version) - Pi Zero optimized" << std::endl;
-    std::cout << "Usage: " << program_name << " [options] <image1> <image2>" << std::endl;
+    std::cout << "Usage: " << program_name << " [options] <image1> <image2> [image3 ...]" << std::endl;
+    std::cout << "       " << program_name << " [options] --stream <dir|fifo|->" << std::endl;
+    std::cout << "       " << program_name << " [options] --stdin-frames" << std::endl;
+    std::cout << "       " << program_name << " [options] --watch <dir>" << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -t <threshold>   Pixel difference threshold (0-255, default: 25)" << std::endl;
     std::cout << "  -s <scale>       Decode scale factor (1=full, 2=half, 4=quarter, 8=eighth, default: 1)" << std::endl;
@@ -336,9 +3249,32 @@ void print_usage(const char* program_name) {
     std::cout << "  -m <motion>      Motion threshold percentage (default: 1.0)" << std::endl;
     std::cout << "  -rgb             Use RGB mode (slower than grayscale)" << std::endl;
     std::cout << "  -u               Ultra-fast mode (fastest IDCT + upsampling, lower quality)" << std::endl;
-    std::cout << "  -b               Apply fast blur for noise reduction (separable filter)" << std::endl;
+    std::cout << "  -b [radius]      Apply fast blur for noise reduction (separable box filter, default radius 1 = 3x3)" << std::endl;
+    std::cout << "  --blur-passes <n> Repeat the box blur n times (2-3 approximate a Gaussian, default: 1)" << std::endl;
+    std::cout << "  --block <n>      Compare the means of nxn blocks instead of pixels (e.g. 16)" << std::endl;
+    std::cout << "  --dc             Compare only the luma DC coefficient of each 8x8 JPEG block (1/8 scale, no IDCT)" << std::endl;
+    std::cout << "  --coeff          Compare quantized DCT blocks, decoding only ambiguous blocks (full resolution, luma)" << std::endl;
+    std::cout << "  --decide         Decision only: stop as soon as the result against -m is known" << std::endl;
+    std::cout << "  --lockstep       Decode both images row by row and diff each batch immediately (few rows of memory)" << std::endl;
+    std::cout << "  --background <k> Streams: compare with a running-average background, alpha = 1/2^k (1-8)" << std::endl;
+    std::cout << "  --grid <CxR>     Also print a C x R tile map of motion percentages as a JSON line" << std::endl;
+    std::cout << "  --grid-bin <file> Also write the tile map in binary (MDG1 header, one byte per tile)" << std::endl;
+    std::cout << "  --sample <n>     Estimate motion from about n sampled pixels, with a 95% confidence interval" << std::endl;
+    std::cout << "  --sample-random  Stratified random samples instead of a fixed lattice (use with --sample)" << std::endl;
     std::cout << "  -v               Verbose output (includes timing breakdown)" << std::endl;
-    std::cout << "  -f               File size check mode (fast pre-check)" << std::endl;
+    std::cout << "  -f [threshold]   File size check mode (fast pre-check, default threshold 5%)" << std::endl;
+    std::cout << "  -j <threads>     Worker threads for motion calculation (0 = all cores, default: 1)" << std::endl;
+    std::cout << "  --mask <pgm>     Region of interest: binary PGM, nonzero pixels are analysed" << std::endl;
+    std::cout << "  --ignore x,y,w,h Exclude a rectangle (source pixels, may be repeated)" << std::endl;
+    std::cout << "  --roi x,y,w,h    Decode and analyse only this rectangle (source pixels, combines with -s)" << std::endl;
+    std::cout << "  --mmap           Map input files into memory instead of reading them (fewer syscalls)" << std::endl;
+    std::cout << "  --hugepages      Back frame buffers of 1 MB and more with transparent huge pages (Linux)" << std::endl;
+    std::cout << "  --no-simd        Use the scalar diff kernel (results are identical, for verification)" << std::endl;
+    std::cout << "  --stream <src>   Streaming mode: compare each frame with the previous one, decoding it once" << std::endl;
+    std::cout << "                   <src> is a directory, a file/FIFO with one path per line, or - for stdin" << std::endl;
+    std::cout << "  --watch <dir>    Watch mode: compare each JPEG completed in <dir> (inotify) with the previous one" << std::endl;
+    std::cout << "  --stdin-frames   Streaming mode reading JPEG frames from stdin (4-byte big-endian size + data)" << std::endl;
+    std::cout << "  --bench-blur     Benchmark the vertical blur pass (column vs row order) and exit" << std::endl;
     std::cout << "  --help           Show this help" << std::endl;
     std::cout << std::endl;
     std::cout << "Supported formats: JPEG (with hardware decode scaling)" << std::endl;
@@ -348,46 +3284,185 @@ void print_usage(const char* program_name) {
 int main(int argc, char* argv[]) {
     MotionDetectionParams params;
     
-    if (argc < 3) {
-        print_usage(argv[0]);
-        return 1;
-    }
-    
-    // Parse command line arguments
-    int img_arg_start = 1;
-    for (int i = 1; i < argc - 2; i++) {
+    // Parse command line arguments (options may appear before or after the images)
+    std::vector<const char*> image_paths;
+    const char* stream_source = nullptr;
+    const char* watch_directory = nullptr;
+    bool stdin_frames = false;
+    for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
             params.pixel_threshold = std::atoi(argv[++i]);
-            img_arg_start = i + 1;
         } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
             params.scale_factor = std::atoi(argv[++i]);
-            img_arg_start = i + 1;
         } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
             params.motion_threshold = std::atof(argv[++i]);
-            img_arg_start = i + 1;
         } else if (strcmp(argv[i], "-rgb") == 0) {
             params.use_rgb = true;
-            img_arg_start = i + 1;
         } else if (strcmp(argv[i], "-u") == 0) {
             params.ultra_fast = true;
-            img_arg_start = i + 1;
         } else if (strcmp(argv[i], "-b") == 0) {
             params.enable_blur = true;
-            img_arg_start = i + 1;
+            // Optional radius: -b 3
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]) && !strchr(argv[i + 1], '.')) {
+                params.blur_radius = std::max(1, std::atoi(argv[++i]));
+            }
+        } else if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &params.grid_cols, &params.grid_rows) != 2 ||
+                params.grid_cols < 1 || params.grid_rows < 1 || params.grid_cols > 256 || params.grid_rows > 256) {
+                std::cerr << "Invalid grid (expected CxR, 1-256 each): " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--grid-bin") == 0 && i + 1 < argc) {
+            params.grid_bin = argv[++i];
+        } else if (strcmp(argv[i], "--background") == 0 && i + 1 < argc) {
+            params.background_shift = std::max(1, std::min(8, std::atoi(argv[++i])));
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            params.sample_budget = (size_t)std::max(0L, std::atol(argv[++i]));
+        } else if (strcmp(argv[i], "--sample-random") == 0) {
+            params.sample_random = true;
+        } else if (strcmp(argv[i], "--lockstep") == 0) {
+            params.lockstep = true;
+        } else if (strcmp(argv[i], "--decide") == 0) {
+            params.decision_only = true;
+        } else if (strcmp(argv[i], "--coeff") == 0) {
+            params.coefficient_compare = true;
+        } else if (strcmp(argv[i], "--dc") == 0) {
+            params.dc_only = true;
+        } else if (strcmp(argv[i], "--block") == 0 && i + 1 < argc) {
+            params.block_size = std::max(0, std::min(256, std::atoi(argv[++i])));
+        } else if (strcmp(argv[i], "--blur-passes") == 0 && i + 1 < argc) {
+            params.blur_passes = std::max(1, std::min(4, std::atoi(argv[++i])));
         } else if (strcmp(argv[i], "-v") == 0) {
             params.verbose = true;
-            img_arg_start = i + 1;
         } else if (strcmp(argv[i], "-f") == 0) {
             params.file_size_check = true;
-            img_arg_start = i + 1;
+            // Optional threshold: -f 10 (a number, so it is not taken as an image path)
+            if (i + 1 < argc) {
+                char* end = nullptr;
+                float threshold = strtof(argv[i + 1], &end);
+                if (end != argv[i + 1] && *end == '\0') {
+                    params.file_size_threshold = threshold;
+                    i++;
+                }
+            }
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            params.threads = std::max(0, std::atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--hugepages") == 0) {
+            g_frame_pool.set_hugepages(true);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            params.use_mmap = true;
+        } else if (strcmp(argv[i], "--no-simd") == 0) {
+            params.use_simd = false;
+        } else if (strcmp(argv[i], "--mask") == 0 && i + 1 < argc) {
+            if (!load_pgm_mask(argv[++i], params.mask)) {
+                std::cerr << "Cannot load mask (expected binary 8-bit PGM): " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--ignore") == 0 && i + 1 < argc) {
+            MaskRect rect;
+            if (!parse_rect(argv[++i], rect)) {
+                std::cerr << "Invalid rectangle (expected x,y,w,h): " << argv[i] << std::endl;
+                return 1;
+            }
+            params.mask.ignore.push_back(rect);
+        } else if (strcmp(argv[i], "--roi") == 0 && i + 1 < argc) {
+            if (!parse_rect(argv[++i], params.roi)) {
+                std::cerr << "Invalid ROI (expected x,y,w,h): " << argv[i] << std::endl;
+                return 1;
+            }
+            params.use_roi = true;
+        } else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            stream_source = argv[++i];
+        } else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+            watch_directory = argv[++i];
+        } else if (strcmp(argv[i], "--stdin-frames") == 0) {
+            stdin_frames = true;
+        } else if (strcmp(argv[i], "--bench-blur") == 0) {
+            return run_blur_benchmark();
         } else if (strcmp(argv[i], "--help") == 0) {
             print_usage(argv[0]);
             return 0;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            // Unknown options are ignored
+        } else {
+            image_paths.push_back(argv[i]);
+        }
+    }
+    
+    // The grid is counted by the per-pixel diff, which must visit every pixel
+    if (params.grid_cols > 0 && (params.block_size > 1 || params.sample_budget > 0 || params.coefficient_compare ||
+                                 params.decision_only)) {
+        std::cerr << "--grid cannot be combined with --block, --sample, --coeff or --decide" << std::endl;
+        return 1;
+    }
+    // The background model blends every pixel of every frame
+    if (params.background_shift > 0 && (params.block_size > 1 || params.sample_budget > 0 ||
+                                        params.coefficient_compare || params.decision_only)) {
+        std::cerr << "--background cannot be combined with --block, --sample, --coeff or --decide" << std::endl;
+        return 1;
+    }
+    if (params.background_shift > 0 && !stream_source && !stdin_frames && !watch_directory &&
+        image_paths.size() <= 2) {
+        std::cerr << "--background needs --stream, --watch, --stdin-frames or more than two images" << std::endl;
+        return 1;
+    }
+    // Lockstep and coefficient compares work on a pair of files; streams keep the previous frame decoded instead
+    if ((params.lockstep || params.coefficient_compare) &&
+        (stream_source || watch_directory || stdin_frames || image_paths.size() > 2)) {
+        std::cerr << "--lockstep and --coeff compare two images; they cannot be combined with --stream, --watch, "
+                  << "--stdin-frames or more than two images" << std::endl;
+        return 1;
+    }
+    if (!params.grid_bin.empty() && params.grid_cols <= 0) {
+        std::cerr << "--grid-bin needs --grid" << std::endl;
+        return 1;
+    }
+    
+    if (stdin_frames) {
+        if (params.verbose) {
+            std::cout << "Motion Detector (libjpeg-turbo) reading length-prefixed frames from stdin" << std::endl;
+        }
+        return run_stdin_frames(params);
+    }
+    
+    if (watch_directory) {
+        if (params.verbose) {
+            std::cout << "Motion Detector (libjpeg-turbo) watching " << watch_directory << std::endl;
+            if (params.file_size_check) std::cout << "File size check is not used in watch mode" << std::endl;
+        }
+        return run_watch(watch_directory, params);
+    }
+    
+    if (stream_source) {
+        if (params.verbose) {
+            std::cout << "Motion Detector (libjpeg-turbo) streaming from " << stream_source << std::endl;
+            if (params.file_size_check) std::cout << "File size check is not used in streaming mode" << std::endl;
         }
+        return run_stream_source(stream_source, params);
     }
     
-    const char* image1_path = argv[argc - 2];
-    const char* image2_path = argv[argc - 1];
+    // More than two images: compare consecutive pairs, decoding every frame once
+    if (image_paths.size() > 2) {
+        if (params.verbose) {
+            std::cout << "Motion Detector (libjpeg-turbo) comparing a sequence of " << image_paths.size()
+                      << " frames" << std::endl;
+            if (params.file_size_check) std::cout << "File size check is not used in sequence mode" << std::endl;
+        }
+        size_t next = 0;
+        return run_stream([&](StreamFrame& frame) {
+            if (next >= image_paths.size()) return false;
+            frame.name = image_paths[next++];
+            return true;
+        }, params);
+    }
+    
+    if (image_paths.size() != 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    const char* image1_path = image_paths[0];
+    const char* image2_path = image_paths[1];
     
     if (params.verbose) {
         std::cout << "Motion Detector (libjpeg-turbo) starting..." << std::endl;
@@ -411,55 +3486,97 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    if (params.coefficient_compare) {
+        return run_coefficient_compare(image1_path, image2_path, params);
+    }
+    // A sampled comparison decodes only the sampled rows of the two JPEGs
+    bool sampled_jpegs = params.sample_budget > 0 && is_jpeg_filename(image1_path) && is_jpeg_filename(image2_path);
+    if (sampled_jpegs || (params.lockstep && params.block_size <= 1)) {
+        return run_lockstep_compare(image1_path, image2_path, params);
+    }
+    
     // Load images with scaling
-    int width1, height1, channels1;
+    int width1, height1, channels1, scale_denom1;
     int width2, height2, channels2;
     
+    typedef std::chrono::high_resolution_clock::time_point TimePoint;
+    TimePoint decode1_start, decode1_end, decode2_start, decode2_end;
+    unsigned char* img2 = nullptr;
+    auto decode_image2 = [&] {
+        decode2_start = std::chrono::high_resolution_clock::now();
+        img2 = load_image_safe(image2_path, &width2, &height2, &channels2, params);
+        decode2_end = std::chrono::high_resolution_clock::now();
+    };
+    
+    // On multi-core hosts image2 is decoded on a second thread while this thread decodes image1
+    bool parallel_decode = std::thread::hardware_concurrency() > 1;
+    
     auto load_start = std::chrono::high_resolution_clock::now();
     
-    unsigned char* img1 = load_image_safe(image1_path, &width1, &height1, &channels1, 
-                                          params.scale_factor, params.verbose, params.ultra_fast);
+    std::thread decode_thread;
+    if (parallel_decode) decode_thread = std::thread(decode_image2);
+    
+    decode1_start = std::chrono::high_resolution_clock::now();
+    unsigned char* img1 = load_image_safe(image1_path, &width1, &height1, &channels1, params, &scale_denom1);
+    decode1_end = std::chrono::high_resolution_clock::now();
+    
+    if (parallel_decode) {
+        decode_thread.join();
+    } else if (img1) {
+        decode_image2();
+    }
+    
+    auto load_end = std::chrono::high_resolution_clock::now();
+    
     if (!img1) {
         std::cerr << "Failed to load image: " << image1_path << std::endl;
+        g_frame_pool.release(img2);
         return 1;
     }
     
-    unsigned char* img2 = load_image_safe(image2_path, &width2, &height2, &channels2, 
-                                          params.scale_factor, params.verbose, params.ultra_fast);
     if (!img2) {
         std::cerr << "Failed to load image: " << image2_path << std::endl;
-        free(img1);
+        g_frame_pool.release(img1);
         return 1;
     }
     
-    auto load_end = std::chrono::high_resolution_clock::now();
-    
     // Check dimensions match
     if (width1 != width2 || height1 != height2 || channels1 != channels2) {
         std::cerr << "Image dimensions don't match after scaling!" << std::endl;
         std::cerr << "Image 1: " << width1 << "x" << height1 << " (channels: " << channels1 << ")" << std::endl;
         std::cerr << "Image 2: " << width2 << "x" << height2 << " (channels: " << channels2 << ")" << std::endl;
-        free(img1);
-        free(img2);
+        g_frame_pool.release(img1);
+        g_frame_pool.release(img2);
         return 1;
     }
     
+    // Compile the region-of-interest mask for this frame size
+    MotionMask mask;
+    if (!params.mask.empty()) {
+        compile_motion_mask(params.mask, width1, height1, scale_denom1, mask,
+                            params.use_roi ? std::max(0, params.roi.x) / scale_denom1 : 0,
+                            params.use_roi ? std::max(0, params.roi.y) / scale_denom1 : 0);
+        if (params.verbose) {
+            std::cout << "Mask: " << mask.spans.size() << " spans, " << mask.active_pixels << " of "
+                      << ((size_t)width1 * height1) << " pixels active" << std::endl;
+        }
+    }
+    
     // Calculate motion
     auto motion_start = std::chrono::high_resolution_clock::now();
-    float motion_percentage = calculate_motion_scaled(img1, img2, width1, height1, channels1, params);
+    bool stopped_early = false;
+    SampleEstimate estimate;
+    MotionGrid grid;
+    float motion_percentage = calculate_motion_scaled(img1, img2, width1, height1, channels1, params,
+                                                      params.mask.empty() ? nullptr : &mask, &stopped_early,
+                                                      &estimate, &grid);
     auto motion_end = std::chrono::high_resolution_clock::now();
     
     auto end_time = std::chrono::high_resolution_clock::now();
     
     // Output results
-    std::cout << std::fixed << std::setprecision(2);
-    std::cout << "Motion detected: " << motion_percentage << "%" << std::endl;
-    
-    if (motion_percentage >= params.motion_threshold) {
-        std::cout << "MOTION DETECTED (threshold: " << params.motion_threshold << "%)" << std::endl;
-    } else {
-        std::cout << "No significant motion (threshold: " << params.motion_threshold << "%)" << std::endl;
-    }
+    print_motion_result(motion_percentage, params, stopped_early, params.sample_budget > 0 ? &estimate : nullptr);
+    if (params.grid_cols > 0) print_motion_grid(grid, motion_percentage, params);
     
     if (params.verbose) {
         auto total_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
@@ -467,7 +3584,16 @@ int main(int argc, char* argv[]) {
         auto motion_duration = std::chrono::duration_cast<std::chrono::microseconds>(motion_end - motion_start);
         
         std::cout << "Timing breakdown:" << std::endl;
-        std::cout << "  Image loading: " << (load_duration.count() / 1000.0) << " ms" << std::endl;
+        auto decode1_duration = std::chrono::duration_cast<std::chrono::microseconds>(decode1_end - decode1_start);
+        auto decode2_duration = std::chrono::duration_cast<std::chrono::microseconds>(decode2_end - decode2_start);
+        auto overlap_duration = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::min(decode1_end, decode2_end) - std::max(decode1_start, decode2_start));
+        
+        std::cout << "  Image loading: " << (load_duration.count() / 1000.0) << " ms"
+                  << (parallel_decode ? " (parallel decode)" : "") << std::endl;
+        std::cout << "    Image 1 decode: " << (decode1_duration.count() / 1000.0) << " ms" << std::endl;
+        std::cout << "    Image 2 decode: " << (decode2_duration.count() / 1000.0) << " ms" << std::endl;
+        std::cout << "    Decode overlap: " << (std::max<int64_t>(0, overlap_duration.count()) / 1000.0) << " ms" << std::endl;
         std::cout << "  Motion calc:   " << (motion_duration.count() / 1000.0) << " ms" << std::endl;
         std::cout << "  Total time:    " << (total_duration.count() / 1000.0) << " ms" << std::endl;
     }
@@ -478,11 +3604,20 @@ int main(int argc, char* argv[]) {
         std::cout << "Pixel threshold: " << params.pixel_threshold << std::endl;
         std::cout << "RGB mode: " << (params.use_rgb ? "enabled" : "disabled (grayscale)") << std::endl;
         std::cout << "Ultra-fast mode: " << (params.ultra_fast ? "enabled (fastest IDCT + upsampling)" : "disabled") << std::endl;
+        std::cout << "Diff kernel: " << select_diff_kernels(params.use_simd).name
+                  << " (" << resolve_thread_count(params.threads) << " threads)" << std::endl;
+        if (params.block_size > 1) {
+            std::cout << "Block compare: " << params.block_size << "x" << params.block_size << " means ("
+                      << (width1 + params.block_size - 1) / params.block_size << "x"
+                      << (height1 + params.block_size - 1) / params.block_size << " blocks)" << std::endl;
+        }
+        std::cout << "Decode: " << g_decode_stats.scanlines << " scanlines in " << g_decode_stats.scanline_calls
+                  << " read calls, " << g_decode_stats.bytes_copied << " bytes copied" << std::endl;
     }
     
     // Cleanup
-    free(img1);
-    free(img2);
+    g_frame_pool.release(img1);
+    g_frame_pool.release(img2);
     
     return motion_percentage >= params.motion_threshold ? 0 : 1;
 } 
\ No newline at end of file